@@ -0,0 +1,62 @@
+#ifndef HGCalCellTable_h
+#define HGCalCellTable_h
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+#include "DataFormats/DetId/interface/DetId.h"
+#include "DataFormats/GeometryVector/interface/GlobalPoint.h"
+
+class CaloGeometry;
+
+/*
+Position, layer and subdetector of every HGCAL cell, keyed by DetId.
+The table is built once per geometry (see HGCalCellTableESProducer) and only read afterwards,
+so it can be shared by all streams. The cells are stored as a structure of arrays sorted by
+raw DetId, 18 bytes per cell, and found by binary search on the raw DetIds. For the roughly
+six million cells of the full HGCAL geometry that is about 100 MB per geometry IOV, and
+about 23 comparisons per lookup.
+*/
+class HGCalCellTable {
+    public:
+        static constexpr uint32_t kNotFound = std::numeric_limits<uint32_t>::max();
+
+        /* Collects the cells of the HGCAL subdetectors of this geometry */
+        explicit HGCalCellTable(const CaloGeometry& geom);
+
+        /* An empty table, to be filled with addCell, e.g. with the cells of a test geometry */
+        HGCalCellTable() {}
+
+        /* Appends a cell; the cells must be added in increasing order of raw DetId */
+        void addCell(DetId id, const GlobalPoint& position, unsigned layer){
+            rawId_.push_back(id.rawId());
+            x_.push_back(position.x()); y_.push_back(position.y()); z_.push_back(position.z());
+            layer_.push_back(layer);
+            det_.push_back(id.det());
+            }
+
+        /* Index of the cell with this DetId, or kNotFound */
+        uint32_t find(DetId id) const {
+            uint32_t raw = id.rawId();
+            auto it = std::lower_bound(rawId_.begin(), rawId_.end(), raw);
+            return (it != rawId_.end() && *it == raw) ? (uint32_t)(it - rawId_.begin()) : kNotFound;
+            }
+
+        GlobalPoint position(uint32_t cell) const { return GlobalPoint(x_[cell], y_[cell], z_[cell]); }
+        unsigned layer(uint32_t cell) const { return layer_[cell]; }
+        DetId::Detector det(uint32_t cell) const { return (DetId::Detector)det_[cell]; }
+        DetId detId(uint32_t cell) const { return DetId(rawId_[cell]); }
+        size_t size() const { return rawId_.size(); }
+
+    private:
+        std::vector<uint32_t> rawId_;
+        std::vector<float> x_;
+        std::vector<float> y_;
+        std::vector<float> z_;
+        std::vector<uint8_t> layer_; // HGCAL layers are numbered per subdetector, well below 256
+        std::vector<uint8_t> det_;
+    };
+
+#endif
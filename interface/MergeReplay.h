@@ -0,0 +1,107 @@
+#ifndef MergeReplay_h
+#define MergeReplay_h
+
+#include <vector>
+#include <cstddef>
+#include <numeric>
+#include <memory_resource>
+
+#include "SimMerging/SimMerger/interface/SimTreeMerging.h"
+
+/*
+Snapshot of the tree that goes into the merging of simmerger, as recorded with
+recordMergeTree = True (products mergeTreeNodes, mergeTreeSums and mergeTreeFirstHits): the
+nodes in depth-first order, the primaries and their subtrees in the order of the children of
+the root, with everything the merging looks at. Per node, mergeTreeNodes holds 4 ints
+(position of the parent, or -1 for a primary; the key of the input SimCluster in
+mix:MergedCaloTruth; pdg id; number of hits), mergeTreeSums 5 doubles (SimTrack energy; sum
+of the hit energies; sums of the energy-weighted x, y and z) and mergeTreeFirstHits 3 floats
+(first hit not at the origin). That is 68 bytes per node: a full copy of the node summaries,
+not a compact record. simmerger records the SimTrack index instead of the key, and swaps it
+at the output.
+*/
+class MergeTreeSnapshot {
+    public:
+        static constexpr size_t kInts = 4;
+        static constexpr size_t kSums = 5;
+        static constexpr size_t kFirstHits = 3;
+
+        void clear(){ nodes_.clear(); sums_.clear(); firstHits_.clear(); }
+
+        /* Appends the subtree below top (top included) as a primary; call before merging */
+        void add(SimTree& tree, NodeIndex top){
+            position_.resize(tree.size());
+            for (NodeIndex node : tree.subtree(top)){
+                position_[node] = size();
+                GlobalPoint firstHit = tree.firstHitPosition_[node];
+                nodes_.insert(nodes_.end(), {
+                    node == top ? -1 : position_[tree.parent_[node]], (int)tree.track_[node],
+                    tree.pdgid_[node], tree.nhits(node)
+                    });
+                sums_.insert(sums_.end(), {
+                    tree.energy_[node], tree.sumE_[node], tree.sumEx_[node], tree.sumEy_[node], tree.sumEz_[node]
+                    });
+                firstHits_.insert(firstHits_.end(), {firstHit.x(), firstHit.y(), firstHit.z()});
+                }
+            }
+
+        size_t size() const { return nodes_.size() / kInts; }
+        size_t memoryBytes(bool inUse) const { return vectorBytes(inUse, nodes_, sums_, firstHits_, position_); }
+
+        std::vector<int> nodes_;
+        std::vector<double> sums_;
+        std::vector<float> firstHits_;
+    private:
+        std::vector<int> position_; // Scratch: position of every node of the tree in the snapshot
+    };
+
+/*
+Clustering at another merge radius from a tree recorded by simmerger (see MergeTreeSnapshot).
+
+Returns for every input SimCluster key 0 ... nSources-1 the key of the representative of its
+cluster, as simmerger would have merged them with maxMergeRadius = radius; keys that are in
+no cluster (not in the tree, or an intermediate without hits that the merging drops) are
+their own representative. The merging is replayed on the recorded hit summaries with the
+same algorithm, so the result is exactly that of re-running simmerger at this radius, for
+any radius. It costs about as much as the merging stage of simmerger, but needs neither the
+hits nor the geometry. The pdg id that a cluster inherits from a parent when all its
+children merge is not returned.
+
+The merge history (recordMergeHistory) is not enough for this: with a smaller radius, nodes
+that stay separate are offered again one level up and can merge differently, so the
+clustering at a smaller radius is not a cut of the recorded merges.
+*/
+inline std::vector<unsigned> replayMerging(
+        size_t nSources,
+        const std::vector<int>& treeNodes,
+        const std::vector<double>& treeSums,
+        const std::vector<float>& treeFirstHits,
+        float radius
+        ){
+    const size_t kInts = MergeTreeSnapshot::kInts, kSums = MergeTreeSnapshot::kSums, kFirstHits = MergeTreeSnapshot::kFirstHits;
+    size_t nNodes = treeNodes.size() / kInts;
+    SimTree tree;
+    tree.clear(nNodes, 0);
+    std::vector<NodeIndex> nodeAt(nNodes);
+    for (size_t i = 0; i < nNodes; ++i){
+        const int* node = &treeNodes[kInts*i];
+        const double* sums = &treeSums[kSums*i];
+        const float* firstHit = &treeFirstHits[kFirstHits*i];
+        nodeAt[i] = tree.addNode(node[1], sums[0], node[2], node[1]);
+        tree.setHitSummary(nodeAt[i], node[3], sums[1], sums[2], sums[3], sums[4], GlobalPoint(firstHit[0], firstHit[1], firstHit[2]));
+        tree.addChild(node[0] < 0 ? tree.root() : nodeAt[node[0]], nodeAt[i]);
+        }
+    ClusteringEngine engine;
+    merging_algo_Mar03(tree, engine, std::pmr::new_delete_resource(), radius, nullptr);
+
+    std::vector<unsigned> representative(nSources);
+    std::iota(representative.begin(), representative.end(), 0u);
+    for (NodeIndex cluster = tree.firstChild_[tree.root()]; cluster != kNoNode; cluster = tree.nextSibling_[cluster]){
+        for (uint32_t member = tree.firstMember_[cluster]; member != SimTree::kNoMember; member = tree.memberNext_[member]){
+            representative[tree.memberTrack_[member]] = tree.track_[cluster];
+            }
+        }
+    return representative;
+    }
+
+#endif
@@ -0,0 +1,1217 @@
+#ifndef SimTreeMerging_h
+#define SimTreeMerging_h
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <utility>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include <memory_resource>
+#include <iterator> // For std::forward_iterator_tag
+#include <cstddef>  // For std::ptrdiff_t
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "DataFormats/GeometryVector/interface/GlobalPoint.h"
+#include "FWCore/MessageLogger/interface/MessageLogger.h"
+#include "FWCore/Utilities/interface/Exception.h"
+
+/*
+The SimTrack tree of simmerger and the merging algorithm that runs on it. Nothing here depends
+on the event or the geometry: filling the tree is up to the user, so the merging can also be
+run outside the framework.
+*/
+
+/*
+Log levels of simmerger, from per-event summaries to a trace of the tree building and dumps
+of the whole tree. Messages above SIMMERGER_MAX_LOG_LEVEL (e.g. -DSIMMERGER_MAX_LOG_LEVEL=0
+in the flags of the BuildFile) are compiled out. The others are only formatted, and their
+arguments only evaluated, if the run-time level is high enough, so a disabled message costs
+a single comparison.
+*/
+enum SimMergerLogLevel { kLogNone, kLogEvent, kLogMerges, kLogTree };
+#ifndef SIMMERGER_MAX_LOG_LEVEL
+#define SIMMERGER_MAX_LOG_LEVEL kLogTree
+#endif
+constexpr bool simMergerLogOn(int level, int runLevel){
+    return level <= SIMMERGER_MAX_LOG_LEVEL && level <= runLevel;
+    }
+#define SIMMERGER_LOG(level, runLevel) \
+    if (!simMergerLogOn(level, runLevel)) {} else edm::LogVerbatim("SimMerging")
+
+/* Index of a node in a SimTree; 32 bits are plenty for the SimTracks of one event */
+typedef uint32_t NodeIndex;
+const NodeIndex kNoNode = std::numeric_limits<NodeIndex>::max();
+const uint32_t kNoHit = std::numeric_limits<uint32_t>::max();
+const uint32_t kNoTrack = std::numeric_limits<uint32_t>::max();
+
+/* Heap memory of some vectors: only the elements in use, or everything allocated */
+template <class... Vectors> size_t vectorBytes(bool inUse, const Vectors&... v){
+    return (((inUse ? v.size() : v.capacity()) * sizeof(typename Vectors::value_type)) + ... + 0);
+    }
+
+/*
+Flat tree of SimTracks, stored as a structure of arrays.
+Nodes refer to each other by 32-bit indices. The children of a node form an intrusive
+doubly linked list (first/last child, previous/next sibling), so finding the next sibling
+or unlinking a node is O(1). The SimTracks merged into a node (members) are an intrusive
+singly linked list of their own, so a merged-away node is not needed any more; building and
+reshaping the tree never allocates per node.
+The hits are counting-sorted by SimTrack once per event, so the hits of a track are a
+contiguous [begin, end) span of the hit arrays. Every node keeps running sums of the energy
+and energy-weighted position of all hits merged into it, so merging two nodes updates their
+hit centroid in O(1). The hits of a merged node are the spans of all its members; they are
+never copied.
+The arrays are only cleared between events (the capacity is kept), which makes a SimTree
+owned by a stream module a per-stream arena.
+*/
+class SimTree {
+    public:
+        /* Resets the tree for a new event and creates the (synthetic) root node */
+        void clear(size_t nNodes=0, size_t nHits=0){
+            trackid_.clear(); track_.clear(); energy_.clear(); pdgid_.clear();
+            parent_.clear(); firstChild_.clear(); lastChild_.clear();
+            prevSibling_.clear(); nextSibling_.clear();
+            firstMember_.clear(); lastMember_.clear(); nhits_.clear();
+            sumE_.clear(); sumEx_.clear(); sumEy_.clear(); sumEz_.clear();
+            hitcentroidCalculated_.clear(); hitcentroid_.clear(); firstHitPosition_.clear();
+            pendingChildren_.clear(); mergeLevel_.clear();
+            memberTrack_.clear(); memberNext_.clear(); hitBegin_.clear(); hitEnd_.clear();
+            clearHits();
+            reserve(nNodes+1, nHits);
+            root_ = addNode(0, 0., 0);
+            }
+
+        void reserve(size_t nNodes, size_t nHits){
+            trackid_.reserve(nNodes); track_.reserve(nNodes); energy_.reserve(nNodes); pdgid_.reserve(nNodes);
+            parent_.reserve(nNodes); firstChild_.reserve(nNodes); lastChild_.reserve(nNodes);
+            prevSibling_.reserve(nNodes); nextSibling_.reserve(nNodes);
+            firstMember_.reserve(nNodes); lastMember_.reserve(nNodes); nhits_.reserve(nNodes);
+            sumE_.reserve(nNodes); sumEx_.reserve(nNodes); sumEy_.reserve(nNodes); sumEz_.reserve(nNodes);
+            hitcentroidCalculated_.reserve(nNodes); hitcentroid_.reserve(nNodes); firstHitPosition_.reserve(nNodes);
+            pendingChildren_.reserve(nNodes); mergeLevel_.reserve(nNodes);
+            memberTrack_.reserve(nNodes); memberNext_.reserve(nNodes); hitBegin_.reserve(nNodes); hitEnd_.reserve(nNodes);
+            hitX_.reserve(nHits); hitY_.reserve(nHits); hitZ_.reserve(nHits); hitT_.reserve(nHits); hitE_.reserve(nHits);
+            hitTrack_.reserve(nHits);
+            }
+
+        NodeIndex addNode(int trackid, float energy, int pdgid, uint32_t track=kNoTrack){
+            NodeIndex node = trackid_.size();
+            trackid_.push_back(trackid);
+            track_.push_back(track);
+            energy_.push_back(energy);
+            pdgid_.push_back(pdgid);
+            parent_.push_back(kNoNode);
+            firstChild_.push_back(kNoNode);
+            lastChild_.push_back(kNoNode);
+            prevSibling_.push_back(kNoNode);
+            nextSibling_.push_back(kNoNode);
+            firstMember_.push_back(addMember(track));
+            lastMember_.push_back(firstMember_.back());
+            nhits_.push_back(0);
+            sumE_.push_back(0.); sumEx_.push_back(0.); sumEy_.push_back(0.); sumEz_.push_back(0.);
+            hitcentroidCalculated_.push_back(false);
+            hitcentroid_.push_back(GlobalPoint(0.f,0.f,0.f));
+            firstHitPosition_.push_back(GlobalPoint(0.f,0.f,0.f));
+            pendingChildren_.push_back(0);
+            mergeLevel_.push_back(0);
+            return node;
+            }
+
+        /*
+        Copies a node of another tree into a new node without parent or children: its SimTrack,
+        hit summary and members. The hits stay in the other tree, so the members get no hits.
+        */
+        NodeIndex addNodeFrom(const SimTree& other, NodeIndex node){
+            NodeIndex copy = addNode(other.trackid_[node], other.energy_[node], other.pdgid_[node], other.track_[node]);
+            // The first member is the SimTrack of the node itself
+            for (uint32_t member = other.memberNext_[other.firstMember_[node]]; member != kNoMember; member = other.memberNext_[member]){
+                uint32_t added = addMember(other.memberTrack_[member]);
+                memberNext_[lastMember_[copy]] = added;
+                lastMember_[copy] = added;
+                }
+            nhits_[copy] = other.nhits_[node];
+            sumE_[copy] = other.sumE_[node];
+            sumEx_[copy] = other.sumEx_[node];
+            sumEy_[copy] = other.sumEy_[node];
+            sumEz_[copy] = other.sumEz_[node];
+            firstHitPosition_[copy] = other.firstHitPosition_[node];
+            return copy;
+            }
+
+        /* Stores a hit of the SimTrack with (dense) index track in the hit arena; returns its index */
+        uint32_t addHit(float x, float y, float z, float t, float energy, uint32_t track){
+            hitX_.push_back(x); hitY_.push_back(y); hitZ_.push_back(z);
+            hitT_.push_back(t); hitE_.push_back(energy);
+            hitTrack_.push_back(track);
+            return hitTrack_.size()-1;
+            }
+
+        size_t nHitsTotal() const { return hitTrack_.size(); }
+
+        /* Bytes needed per stored hit, including the scratch of sortHits */
+        static constexpr size_t kBytesPerHit = 5*sizeof(float) + sizeof(uint32_t) + 3*sizeof(uint32_t) + sizeof(float);
+
+        /* Heap memory of the tree: what the current event uses, or all capacity held */
+        size_t memoryBytes(bool inUse) const {
+            return vectorBytes(inUse,
+                trackid_, track_, energy_, pdgid_,
+                parent_, firstChild_, lastChild_, prevSibling_, nextSibling_,
+                firstMember_, lastMember_, nhits_, sumE_, sumEx_, sumEy_, sumEz_,
+                hitcentroidCalculated_, hitcentroid_, firstHitPosition_, pendingChildren_, mergeLevel_,
+                memberTrack_, memberNext_, hitBegin_, hitEnd_,
+                hitX_, hitY_, hitZ_, hitT_, hitE_, hitTrack_, hitGroupBegin_,
+                sortGroup_, sortedSlot_, sortScratchIndex_, sortScratch_
+                );
+            }
+
+        /*
+        Drops all hits, keeping the nodes and their hit summaries; the hit spans of the nodes
+        are no longer valid afterwards
+        */
+        void clearHits(){
+            hitX_.clear(); hitY_.clear(); hitZ_.clear(); hitT_.clear(); hitE_.clear();
+            hitTrack_.clear(); hitGroupBegin_.clear();
+            sortGroup_.clear(); sortedSlot_.clear(); sortScratchIndex_.clear(); sortScratch_.clear();
+            }
+
+        /*
+        Stable counting sort of the hit arrays by group, after all hits were added. The group
+        of a hit is groupOfTrack[its SimTrack index], or the SimTrack index itself if
+        groupOfTrack is null; afterwards the hits of group i are
+        [hitGroupBegin_[i], hitGroupBegin_[i+1]).
+        Hit indices handed out by addHit are no longer valid after this.
+        */
+        void sortHits(size_t nGroups, const uint32_t* groupOfTrack=nullptr){
+            size_t n = nHitsTotal();
+            std::vector<uint32_t>& group = sortGroup_;
+            group.resize(n);
+            for (size_t ihit = 0; ihit < n; ++ihit) group[ihit] = groupOfTrack ? groupOfTrack[hitTrack_[ihit]] : hitTrack_[ihit];
+            hitGroupBegin_.assign(nGroups+1, 0);
+            for (uint32_t g : group) hitGroupBegin_[g+1]++;
+            for (size_t i = 0; i < nGroups; ++i) hitGroupBegin_[i+1] += hitGroupBegin_[i];
+            sortedSlot_.resize(n);
+            std::vector<uint32_t>& fill = sortScratchIndex_;
+            fill.assign(hitGroupBegin_.begin(), hitGroupBegin_.end()-1);
+            for (size_t ihit = 0; ihit < n; ++ihit) sortedSlot_[ihit] = fill[group[ihit]]++;
+            for (std::vector<float>* column : {&hitX_, &hitY_, &hitZ_, &hitT_, &hitE_}){
+                sortScratch_.resize(n);
+                for (size_t ihit = 0; ihit < n; ++ihit) sortScratch_[sortedSlot_[ihit]] = (*column)[ihit];
+                column->swap(sortScratch_);
+                }
+            fill.resize(n);
+            for (size_t ihit = 0; ihit < n; ++ihit) fill[sortedSlot_[ihit]] = hitTrack_[ihit];
+            hitTrack_.swap(fill);
+            }
+
+        /* Gives a node the hits of a group (after sortHits), and sums them up */
+        void setHits(NodeIndex node, uint32_t group){
+            uint32_t begin = hitGroupBegin_[group], end = hitGroupBegin_[group+1];
+            hitBegin_[firstMember_[node]] = begin;
+            hitEnd_[firstMember_[node]] = end;
+            double e = 0., ex = 0., ey = 0., ez = 0.;
+            firstHitPosition_[node] = GlobalPoint(0.f,0.f,0.f);
+            for (uint32_t ihit = begin; ihit < end; ++ihit){
+                e += hitE_[ihit];
+                ex += (double)hitE_[ihit] * hitX_[ihit];
+                ey += (double)hitE_[ihit] * hitY_[ihit];
+                ez += (double)hitE_[ihit] * hitZ_[ihit];
+                if (isOrigin(firstHitPosition_[node])) firstHitPosition_[node] = GlobalPoint(hitX_[ihit], hitY_[ihit], hitZ_[ihit]);
+                }
+            nhits_[node] = end - begin;
+            sumE_[node] = e; sumEx_[node] = ex; sumEy_[node] = ey; sumEz_[node] = ez;
+            hitcentroidCalculated_[node] = false;
+            }
+
+        NodeIndex root() const { return root_; }
+        size_t size() const { return trackid_.size(); }
+
+        /*
+        Standard depth-first-search tree traversal as an iterator over node indices.
+        Going back up uses the parent links, so no stack is needed and copying the
+        iterator is cheap; every step is O(1) amortized.
+        */
+        struct Iterator {
+            using iterator_category = std::forward_iterator_tag;
+            using difference_type   = std::ptrdiff_t;
+            using value_type        = NodeIndex;
+            using pointer           = const NodeIndex*;
+            using reference         = NodeIndex;
+
+            Iterator(SimTree* tree, NodeIndex node) :
+                tree_(tree), m_node(node), root(node), depth_(0) {}
+
+            reference operator*() const { return m_node; }
+
+            Iterator& operator++() {
+                SimTree& t = *tree_;
+                if (t.hasChildren(m_node)){
+                    m_node = t.firstChild_[m_node];
+                    depth_++;
+                    }
+                else {
+                    while(true){
+                        if (m_node == root){
+                            m_node = kNoNode;
+                            break;
+                            }
+                        else if (t.hasNextSibling(m_node)){
+                            m_node = t.nextSibling_[m_node];
+                            break;
+                            }
+                        m_node = t.parent_[m_node];
+                        depth_--;
+                        }
+                    }
+                return *this;
+                }
+            // Postfix increment
+            Iterator operator++(int) { Iterator tmp = *this; ++(*this); return tmp; }
+            int depth() const {return depth_;}
+            friend bool operator== (const Iterator& a, const Iterator& b) { return a.m_node == b.m_node; };
+            friend bool operator!= (const Iterator& a, const Iterator& b) { return a.m_node != b.m_node; };
+            private:
+                SimTree* tree_;
+                NodeIndex m_node;
+                NodeIndex root;
+                int depth_;
+            };
+        Iterator begin(NodeIndex node) { return Iterator(this, node); }
+        Iterator end() { return Iterator(this, kNoNode); }
+
+        /* Range over the subtree starting at node, for use in range-based for loops */
+        struct Subtree {
+            SimTree* tree;
+            NodeIndex top;
+            Iterator begin() { return tree->begin(top); }
+            Iterator end() { return tree->end(); }
+            };
+        Subtree subtree(NodeIndex node) { return Subtree{this, node}; }
+
+        /* Appends child to the children of parent, and sets parent as its parent */
+        void addChild(NodeIndex parent, NodeIndex child){
+            prevSibling_[child] = lastChild_[parent];
+            nextSibling_[child] = kNoNode;
+            if (lastChild_[parent] == kNoNode) firstChild_[parent] = child;
+            else nextSibling_[lastChild_[parent]] = child;
+            lastChild_[parent] = child;
+            parent_[child] = parent;
+            }
+        /* Moves the children of a node to the end of a vector, unlinking them from the node */
+        template <class Vector> void takeChildren(NodeIndex node, Vector& children){
+            NodeIndex child = firstChild_[node];
+            while (child != kNoNode){
+                NodeIndex next = nextSibling_[child];
+                prevSibling_[child] = nextSibling_[child] = kNoNode;
+                children.push_back(child);
+                child = next;
+                }
+            clearChildren(node);
+            }
+        /* Forgets all children of a node (the children themselves are left untouched) */
+        void clearChildren(NodeIndex node){
+            firstChild_[node] = kNoNode;
+            lastChild_[node] = kNoNode;
+            }
+
+        int nhits(NodeIndex node) const { return nhits_[node]; }
+        bool hasHits(NodeIndex node) const { return nhits_[node] > 0; }
+        bool isLeaf(NodeIndex node) const { return firstChild_[node] == kNoNode; }
+        bool hasChildren(NodeIndex node) const { return firstChild_[node] != kNoNode; }
+        bool hasSingleChild(NodeIndex node) const {
+            return hasChildren(node) && firstChild_[node] == lastChild_[node];
+            }
+        bool hasParent(NodeIndex node) const { return parent_[node] != kNoNode; }
+        bool hasNextSibling(NodeIndex node) const { return nextSibling_[node] != kNoNode; }
+
+        /* A node is a 'leaf parent' if it has children, and all those children are leafs  */
+        bool isLeafParent(NodeIndex node) const {
+            // A leaf itself is not a leaf parent
+            if (isLeaf(node)) return false;
+            for (NodeIndex child = firstChild_[node]; child != kNoNode; child = nextSibling_[child]){
+                if (hasChildren(child)) return false;
+                }
+            return true;
+            }
+
+        /*
+        Appends the members of node 'from' to those of node 'into', and adds its hit summary;
+        O(1), the hits themselves stay with their tracks
+        */
+        void mergeInto(NodeIndex into, NodeIndex from){
+            // Bookkeep that the track (and any previously merged tracks) is merged in
+            memberNext_[lastMember_[into]] = firstMember_[from];
+            lastMember_[into] = lastMember_[from];
+            if (isOrigin(firstHitPosition_[into])) firstHitPosition_[into] = firstHitPosition_[from];
+            // Combine the hit summaries
+            nhits_[into] += nhits_[from];
+            sumE_[into] += sumE_[from];
+            sumEx_[into] += sumEx_[from];
+            sumEy_[into] += sumEy_[from];
+            sumEz_[into] += sumEz_[from];
+            hitcentroidCalculated_[into] = false;
+            // The merged-away node itself no longer counts as having hits
+            nhits_[from] = 0;
+            sumE_[from] = sumEx_[from] = sumEy_[from] = sumEz_[from] = 0.;
+            }
+
+        /*
+        Calls f(ihit) for all hits of a node, including those of the tracks merged into it;
+        only while the hits are loaded (see clearHits)
+        */
+        template <class F> void forEachHit(NodeIndex node, F&& f) const {
+            for (uint32_t member = firstMember_[node]; member != kNoMember; member = memberNext_[member]){
+                for (uint32_t ihit = hitBegin_[member]; ihit < hitEnd_[member]; ++ihit) f(ihit);
+                }
+            }
+
+        /* Uses a boolean as a guard against unnecessarily recomputing the hit centroid */
+        GlobalPoint hitcentroid(NodeIndex node){
+            if (hitcentroidCalculated_[node]) return hitcentroid_[node];
+            return recomputeHitcentroid(node);
+            }
+
+        /*
+        Force recomputes the hit centroid: the energy-weighted 'average' position of the hits
+        of a node, from the running sums (O(1))
+        */
+        GlobalPoint recomputeHitcentroid(NodeIndex node){
+            GlobalPoint centroid(0.f,0.f,0.f);
+            if (sumE_[node] > 0.){
+                centroid = GlobalPoint(
+                    sumEx_[node]/sumE_[node], sumEy_[node]/sumE_[node], sumEz_[node]/sumE_[node]
+                    );
+                }
+            else if (nhits_[node] > 0){
+                // Only zero-energy hits; fall back to the position of the first one
+                centroid = firstHitPosition_[node];
+                }
+            hitcentroid_[node] = centroid;
+            hitcentroidCalculated_[node] = true;
+            return centroid;
+            }
+
+        /*
+        Sets the hit summary of a node without any hits, for a tree rebuilt from recorded
+        summaries (MergeReplay.h)
+        */
+        void setHitSummary(
+                NodeIndex node, int nhits, double sumE, double sumEx, double sumEy, double sumEz,
+                const GlobalPoint& firstHitPosition
+                ){
+            nhits_[node] = nhits;
+            sumE_[node] = sumE; sumEx_[node] = sumEx; sumEy_[node] = sumEy; sumEz_[node] = sumEz;
+            firstHitPosition_[node] = firstHitPosition;
+            hitcentroidCalculated_[node] = false;
+            }
+
+        /* Traverses tree and builds string representation */
+        std::string stringrep(NodeIndex top){
+            std::stringstream ss;
+            int nTracks = 0;
+            int nHits = 0;
+            for (Iterator it = begin(top); it != end(); ++it){
+                NodeIndex node = *it;
+                for (int i = 0; i < it.depth(); ++i){
+                    ss << "--";
+                    }
+                ss
+                    << "Track " << trackid_[node]
+                    << " (" << nhits(node) << " hits)"
+                    << "\n";
+                nTracks++;
+                nHits += nhits(node);
+                }
+            ss << "In total " << nTracks << " tracks with " << nHits << " hits";
+            return ss.str();
+            }
+
+        // Per-node data
+        std::vector<int> trackid_;
+        std::vector<uint32_t> track_;       // Index of the SimTrack in its container
+        std::vector<float> energy_;
+        std::vector<int> pdgid_;
+        std::vector<NodeIndex> parent_;
+        std::vector<NodeIndex> firstChild_;
+        std::vector<NodeIndex> lastChild_;
+        std::vector<NodeIndex> prevSibling_;
+        std::vector<NodeIndex> nextSibling_;
+        std::vector<uint32_t> firstMember_; // The node's own SimTrack, followed by those merged into it
+        std::vector<uint32_t> lastMember_;
+        std::vector<int> nhits_;            // Number of hits, including those of merged tracks
+        std::vector<double> sumE_;          // Sum of the hit energies
+        std::vector<double> sumEx_;         // Sums of the energy-weighted hit positions
+        std::vector<double> sumEy_;
+        std::vector<double> sumEz_;
+        std::vector<char> hitcentroidCalculated_;
+        std::vector<GlobalPoint> hitcentroid_;
+        std::vector<GlobalPoint> firstHitPosition_; // Of the first hit not at the origin over the members, for zero-energy nodes
+        std::vector<uint32_t> pendingChildren_; // Scratch for merge_bottom_up_Mar03
+        std::vector<int> mergeLevel_;
+        // Per-member data
+        std::vector<uint32_t> memberTrack_; // Index of the SimTrack in its container
+        std::vector<uint32_t> memberNext_;  // Next member of the same node
+        std::vector<uint32_t> hitBegin_;    // Span of the hits of the SimTrack
+        std::vector<uint32_t> hitEnd_;
+        // Per-hit data
+        std::vector<float> hitX_;
+        std::vector<float> hitY_;
+        std::vector<float> hitZ_;
+        std::vector<float> hitT_;
+        std::vector<float> hitE_;
+        std::vector<uint32_t> hitTrack_;    // Index of the SimTrack in its container
+        std::vector<uint32_t> hitGroupBegin_; // Start of the hits of every group, after sorting
+        int logLevel_ = kLogNone; // Run-time SimMergerLogLevel of the functions working on this tree
+        static constexpr uint32_t kNoMember = std::numeric_limits<uint32_t>::max();
+    private:
+        static bool isOrigin(const GlobalPoint& p){ return p.x()==0.f && p.y()==0.f && p.z()==0.f; }
+
+        uint32_t addMember(uint32_t track){
+            memberTrack_.push_back(track);
+            memberNext_.push_back(kNoMember);
+            hitBegin_.push_back(0);
+            hitEnd_.push_back(0);
+            return memberTrack_.size()-1;
+            }
+
+        NodeIndex root_ = kNoNode;
+        std::vector<uint32_t> sortGroup_;   // Scratch for sortHits
+        std::vector<uint32_t> sortedSlot_;
+        std::vector<uint32_t> sortScratchIndex_;
+        std::vector<float> sortScratch_;
+    };
+
+/* Remove a node from its parent's children list in O(1) */
+inline void break_from_parent(SimTree& tree, NodeIndex node){
+    if (!(tree.hasParent(node))){
+        throw cms::Exception("SimMerging")
+            << "Cannot remove root node " << tree.trackid_[node]
+            ;
+        }
+    NodeIndex parent = tree.parent_[node];
+    NodeIndex previous = tree.prevSibling_[node], next = tree.nextSibling_[node];
+    // Node might not be in the list anymore
+    if (previous == kNoNode && tree.firstChild_[parent] != node) return;
+    if (previous == kNoNode) tree.firstChild_[parent] = next;
+    else tree.nextSibling_[previous] = next;
+    if (next == kNoNode) tree.lastChild_[parent] = previous;
+    else tree.prevSibling_[next] = previous;
+    tree.prevSibling_[node] = tree.nextSibling_[node] = kNoNode;
+    }
+
+
+/*
+A block of points in SoA layout, each with an integer tag, for the batched distance kernels.
+The arrays are padded up to a multiple of kWidth with points at infinity, so the kernels
+never need a scalar remainder loop and every distance is computed with the same instructions.
+*/
+struct PointBlock {
+    static const size_t kWidth = 8;
+
+    void clear(){
+        x_.clear(); y_.clear(); z_.clear(); tag_.clear();
+        size_ = 0;
+        }
+
+    void push_back(float x, float y, float z, int tag){
+        x_.push_back(x); y_.push_back(y); z_.push_back(z); tag_.push_back(tag);
+        size_++;
+        }
+
+    /* Pads the arrays; must be called after the last push_back and before any kernel */
+    void pad(){
+        const float inf = std::numeric_limits<float>::infinity();
+        size_t padded = (size_ + kWidth - 1) / kWidth * kWidth;
+        x_.resize(padded, inf); y_.resize(padded, inf); z_.resize(padded, inf);
+        tag_.resize(padded, std::numeric_limits<int>::max());
+        }
+
+    size_t size() const { return size_; }
+    size_t paddedSize() const { return x_.size(); }
+    size_t memoryBytes(bool inUse) const { return vectorBytes(inUse, x_, y_, z_, tag_); }
+
+    std::vector<float> x_;
+    std::vector<float> y_;
+    std::vector<float> z_;
+    std::vector<int> tag_;
+    size_t size_ = 0;
+    };
+
+/*
+Squared distances from one point to a PointBlock. Only squared distances are compared, so
+no sqrt is needed in the clustering loop. On x86 an AVX2 version is picked at runtime when the
+CPU supports it, with SSE2 as the fallback; other platforms use the scalar loop. All versions
+evaluate (dx*dx + dy*dy) + dz*dz in single precision, so they give identical results.
+*/
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMMERGER_X86_KERNELS
+#endif
+
+/* Lexicographic (squared distance, tag) comparison used to pick the closest point */
+inline bool closerInBlock(float d2, int tag, float bestd2, int bestTag){
+    return d2 < bestd2 || (d2 == bestd2 && tag < bestTag);
+    }
+
+#ifdef SIMMERGER_X86_KERNELS
+__attribute__((target("avx2")))
+inline int closestInBlockAVX2(float px, float py, float pz, const PointBlock& b, float& minD2){
+    const __m256 vpx = _mm256_set1_ps(px), vpy = _mm256_set1_ps(py), vpz = _mm256_set1_ps(pz);
+    __m256 best = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    __m256 bestTag = _mm256_castsi256_ps(_mm256_set1_epi32(std::numeric_limits<int>::max()));
+    __m256 bestIdx = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i step = _mm256_set1_epi32(8);
+    for (size_t i = 0; i < b.paddedSize(); i += 8){
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&b.x_[i]), vpx);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&b.y_[i]), vpy);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(&b.z_[i]), vpz);
+        __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+        __m256i tag = _mm256_loadu_si256((const __m256i*)&b.tag_[i]);
+        __m256 take = _mm256_or_ps(
+            _mm256_cmp_ps(d2, best, _CMP_LT_OQ),
+            _mm256_and_ps(_mm256_cmp_ps(d2, best, _CMP_EQ_OQ),
+                _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_castps_si256(bestTag), tag)))
+            );
+        best = _mm256_blendv_ps(best, d2, take);
+        bestTag = _mm256_blendv_ps(bestTag, _mm256_castsi256_ps(tag), take);
+        bestIdx = _mm256_blendv_ps(bestIdx, _mm256_castsi256_ps(idx), take);
+        idx = _mm256_add_epi32(idx, step);
+        }
+    alignas(32) float laneD2[8];
+    alignas(32) int laneTag[8], laneIdx[8];
+    _mm256_store_ps(laneD2, best);
+    _mm256_store_si256((__m256i*)laneTag, _mm256_castps_si256(bestTag));
+    _mm256_store_si256((__m256i*)laneIdx, _mm256_castps_si256(bestIdx));
+    int k = 0;
+    for (int lane = 1; lane < 8; ++lane){
+        if (closerInBlock(laneD2[lane], laneTag[lane], laneD2[k], laneTag[k])) k = lane;
+        }
+    minD2 = laneD2[k];
+    return laneIdx[k];
+    }
+
+inline int closestInBlockSSE(float px, float py, float pz, const PointBlock& b, float& minD2){
+    const __m128 vpx = _mm_set1_ps(px), vpy = _mm_set1_ps(py), vpz = _mm_set1_ps(pz);
+    __m128 best = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    __m128i bestTag = _mm_set1_epi32(std::numeric_limits<int>::max());
+    __m128i bestIdx = _mm_set1_epi32(-1);
+    __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i step = _mm_set1_epi32(4);
+    for (size_t i = 0; i < b.paddedSize(); i += 4){
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(&b.x_[i]), vpx);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(&b.y_[i]), vpy);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(&b.z_[i]), vpz);
+        __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        __m128i tag = _mm_loadu_si128((const __m128i*)&b.tag_[i]);
+        __m128i take = _mm_castps_si128(_mm_or_ps(
+            _mm_cmplt_ps(d2, best),
+            _mm_and_ps(_mm_cmpeq_ps(d2, best), _mm_castsi128_ps(_mm_cmpgt_epi32(bestTag, tag)))
+            ));
+        best = _mm_or_ps(_mm_and_ps(_mm_castsi128_ps(take), d2), _mm_andnot_ps(_mm_castsi128_ps(take), best));
+        bestTag = _mm_or_si128(_mm_and_si128(take, tag), _mm_andnot_si128(take, bestTag));
+        bestIdx = _mm_or_si128(_mm_and_si128(take, idx), _mm_andnot_si128(take, bestIdx));
+        idx = _mm_add_epi32(idx, step);
+        }
+    alignas(16) float laneD2[4];
+    alignas(16) int laneTag[4], laneIdx[4];
+    _mm_store_ps(laneD2, best);
+    _mm_store_si128((__m128i*)laneTag, bestTag);
+    _mm_store_si128((__m128i*)laneIdx, bestIdx);
+    int k = 0;
+    for (int lane = 1; lane < 4; ++lane){
+        if (closerInBlock(laneD2[lane], laneTag[lane], laneD2[k], laneTag[k])) k = lane;
+        }
+    minD2 = laneD2[k];
+    return laneIdx[k];
+    }
+
+__attribute__((target("avx2")))
+inline void squaredDistancesAVX2(float px, float py, float pz, const PointBlock& b, float* out){
+    const __m256 vpx = _mm256_set1_ps(px), vpy = _mm256_set1_ps(py), vpz = _mm256_set1_ps(pz);
+    for (size_t i = 0; i < b.paddedSize(); i += 8){
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&b.x_[i]), vpx);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&b.y_[i]), vpy);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(&b.z_[i]), vpz);
+        _mm256_storeu_ps(out+i, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)));
+        }
+    }
+
+inline void squaredDistancesSSE(float px, float py, float pz, const PointBlock& b, float* out){
+    const __m128 vpx = _mm_set1_ps(px), vpy = _mm_set1_ps(py), vpz = _mm_set1_ps(pz);
+    for (size_t i = 0; i < b.paddedSize(); i += 4){
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(&b.x_[i]), vpx);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(&b.y_[i]), vpy);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(&b.z_[i]), vpz);
+        _mm_storeu_ps(out+i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+        }
+    }
+
+inline bool cpuHasAVX2(){
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+    return hasAVX2;
+    }
+#endif
+
+/*
+Returns the position in the block of the point closest to p, and its squared distance in minD2.
+Ties go to the lowest tag. Returns -1 for an empty block.
+*/
+inline int closestInBlock(const GlobalPoint& p, const PointBlock& b, float& minD2){
+    minD2 = std::numeric_limits<float>::infinity();
+    if (b.size() == 0) return -1;
+#ifdef SIMMERGER_X86_KERNELS
+    if (cpuHasAVX2()) return closestInBlockAVX2(p.x(), p.y(), p.z(), b, minD2);
+    return closestInBlockSSE(p.x(), p.y(), p.z(), b, minD2);
+#else
+    int best = -1;
+    int bestTag = std::numeric_limits<int>::max();
+    for (size_t i = 0; i < b.paddedSize(); ++i){
+        float dx = b.x_[i]-p.x(), dy = b.y_[i]-p.y(), dz = b.z_[i]-p.z();
+        float d2 = (dx*dx + dy*dy) + dz*dz;
+        if (closerInBlock(d2, b.tag_[i], minD2, bestTag)){
+            minD2 = d2;
+            bestTag = b.tag_[i];
+            best = i;
+            }
+        }
+    return best;
+#endif
+    }
+
+/* Writes the squared distances from p to every point of the block to out (paddedSize() entries) */
+inline void squaredDistances(const GlobalPoint& p, const PointBlock& b, float* out){
+#ifdef SIMMERGER_X86_KERNELS
+    if (cpuHasAVX2()) squaredDistancesAVX2(p.x(), p.y(), p.z(), b, out);
+    else squaredDistancesSSE(p.x(), p.y(), p.z(), b, out);
+#else
+    for (size_t i = 0; i < b.paddedSize(); ++i){
+        float dx = b.x_[i]-p.x(), dy = b.y_[i]-p.y(), dz = b.z_[i]-p.z();
+        out[i] = (dx*dx + dy*dy) + dz*dz;
+        }
+#endif
+    }
+
+/*
+Uniform 3D hash grid over points identified by a slot number.
+Points that are closer than the cell size are always in the same or in adjacent cells,
+so a query only has to look at the 27 cells around a point. Every cell holds an intrusive
+doubly linked list of slots, which makes moving a point to another cell O(1).
+The hash table uses open addressing; cells are never removed, so it is sized for the
+maximum number of cells that can be created while clustering.
+*/
+class SpatialGrid {
+    public:
+        /* Starts a new grid for nSlots points, of which at most nMoves will be moved */
+        void init(size_t nSlots, size_t nMoves, float cellSize){
+            invCellSize_ = 1./cellSize;
+            size_t capacity = 16;
+            while (capacity < 2*(nSlots+nMoves)) capacity *= 2;
+            mask_ = capacity-1;
+            tableKeys_.assign(capacity, kEmptyKey);
+            tableHeads_.assign(capacity, -1);
+            cellOf_.assign(nSlots, 0);
+            prev_.assign(nSlots, -1);
+            next_.assign(nSlots, -1);
+            }
+
+        void insert(int slot, const GlobalPoint& p){
+            size_t cell = findOrAddCell(key(cellIndex(p.x()), cellIndex(p.y()), cellIndex(p.z())));
+            cellOf_[slot] = cell;
+            prev_[slot] = -1;
+            next_[slot] = tableHeads_[cell];
+            if (next_[slot] >= 0) prev_[next_[slot]] = slot;
+            tableHeads_[cell] = slot;
+            }
+
+        void remove(int slot){
+            if (prev_[slot] >= 0) next_[prev_[slot]] = next_[slot];
+            else tableHeads_[cellOf_[slot]] = next_[slot];
+            if (next_[slot] >= 0) prev_[next_[slot]] = prev_[slot];
+            prev_[slot] = next_[slot] = -1;
+            }
+
+        void move(int slot, const GlobalPoint& p){
+            remove(slot);
+            insert(slot, p);
+            }
+
+        size_t memoryBytes(bool inUse) const { return vectorBytes(inUse, tableKeys_, tableHeads_, cellOf_, prev_, next_); }
+
+        /* Calls f(slot) for every slot in the 27 cells around p */
+        template <class F> void forEachNear(const GlobalPoint& p, F&& f) const {
+            int64_t ix = cellIndex(p.x()), iy = cellIndex(p.y()), iz = cellIndex(p.z());
+            for (int64_t dx = -1; dx <= 1; ++dx){
+                for (int64_t dy = -1; dy <= 1; ++dy){
+                    for (int64_t dz = -1; dz <= 1; ++dz){
+                        size_t cell = findCell(key(ix+dx, iy+dy, iz+dz));
+                        if (cell == kNoCell) continue;
+                        for (int slot = tableHeads_[cell]; slot >= 0; slot = next_[slot]) f(slot);
+                        }
+                    }
+                }
+            }
+
+    private:
+        static constexpr uint64_t kEmptyKey = std::numeric_limits<uint64_t>::max();
+        static constexpr size_t kNoCell = std::numeric_limits<size_t>::max();
+
+        int64_t cellIndex(float x) const { return (int64_t)std::floor(x*invCellSize_); }
+
+        /* Packs three cell indices (21 bits each) into one key */
+        static uint64_t key(int64_t ix, int64_t iy, int64_t iz){
+            const int64_t offset = 1 << 20, mask = (1 << 21) - 1;
+            return ((uint64_t)((ix+offset) & mask) << 42) | ((uint64_t)((iy+offset) & mask) << 21) | (uint64_t)((iz+offset) & mask);
+            }
+
+        size_t hash(uint64_t k) const { return (size_t)((k * 0x9E3779B97F4A7C15ULL) >> 20) & mask_; }
+
+        size_t findCell(uint64_t k) const {
+            for (size_t i = hash(k); ; i = (i+1) & mask_){
+                if (tableKeys_[i] == k) return i;
+                if (tableKeys_[i] == kEmptyKey) return kNoCell;
+                }
+            }
+
+        size_t findOrAddCell(uint64_t k){
+            for (size_t i = hash(k); ; i = (i+1) & mask_){
+                if (tableKeys_[i] == k) return i;
+                if (tableKeys_[i] == kEmptyKey){
+                    tableKeys_[i] = k;
+                    return i;
+                    }
+                }
+            }
+
+        double invCellSize_ = 1.;
+        size_t mask_ = 0;
+        std::vector<uint64_t> tableKeys_;
+        std::vector<int> tableHeads_;   // First slot in every cell
+        std::vector<size_t> cellOf_;    // Table position of the cell of every slot
+        std::vector<int> prev_;
+        std::vector<int> next_;
+    };
+
+/*
+Agglomerative clustering engine for the mergeable nodes of one leafparent.
+Nodes are addressed by their slot in the mergeable vector. The engine always returns the
+globally closest pair of live slots with a distance below maxr; ties are resolved exactly as
+in a scan over all pairs (i<j) in slot order.
+Every slot caches its nearest live neighbour, and a heap holds those row minima (stale heap
+entries are skipped lazily). Candidate neighbours come from a SpatialGrid over the hit
+centroids with cells just larger than maxr, so only nodes in the 27 surrounding cells are
+ever considered. After a merge only rows near the survivor's old and new centroid
+and near the absorbed node are revisited, and the survivor is moved in the grid; the cost
+depends on the local density of nodes rather than on the number of children. For a
+handful of nodes the grid does not pay off, and all live slots are candidates.
+The centroids are kept in SoA arrays per slot; candidates are gathered into a PointBlock and
+handed to the batched squared distance kernels, and all comparisons use squared distances.
+The bruteForce mode keeps a full rescan after every merge, with the same kernels, as a reference.
+*/
+class ClusteringEngine {
+    public:
+        explicit ClusteringEngine(bool bruteForce=false) : bruteForce_(bruteForce) {}
+
+        /* Work done since the last resetCounters */
+        struct Counters {
+            uint64_t inits = 0;      // Sets of nodes clustered (one per leafparent)
+            uint64_t iterations = 0; // Calls of closestPair
+            uint64_t distances = 0;  // Distances computed
+            uint64_t merges = 0;
+            };
+        const Counters& counters() const { return counters_; }
+        void resetCounters(){ counters_ = Counters(); }
+
+        /* Starts clustering a new set of nodes */
+        void init(SimTree& tree, const std::pmr::vector<NodeIndex>& nodes, float maxr){
+            counters_.inits++;
+            tree_ = &tree;
+            nodes_ = &nodes;
+            maxr2_ = maxr*maxr;
+            int n = nodes.size();
+            cx_.resize(n); cy_.resize(n); cz_.resize(n);
+            for (int i = 0; i < n; ++i) storeCentroid(i);
+            alive_.assign(n, true);
+            nn_.assign(n, -1);
+            nnr2_.assign(n, maxr2_);
+            stamp_.assign(n, 0);
+            visited_.assign(n, 0);
+            visitStamp_ = 0;
+            heap_.clear();
+            if (bruteForce_ || maxr <= 0.) return;
+            useGrid_ = (n > kMinGridSize);
+            if (useGrid_){
+                // Slightly larger cells, so rounding can never hide a pair just below maxr
+                grid_.init(n, n, maxr*1.001);
+                for (int i = 0; i < n; ++i) grid_.insert(i, centroid(i));
+                }
+            for (int i = 0; i < n; ++i) rescanRow(i);
+            }
+
+        /* Finds the closest pair of live slots (left < right) with r < maxr */
+        bool closestPair(int& left, int& right, float& r){
+            counters_.iterations++;
+            if (bruteForce_) return closestPairBruteForce(left, right, r);
+            while (!heap_.empty()){
+                const HeapEntry& top = heap_.front();
+                if (alive_[top.row] && top.stamp == stamp_[top.row]){
+                    left = top.left; right = top.right; r = std::sqrt(top.r2);
+                    return true;
+                    }
+                std::pop_heap(heap_.begin(), heap_.end(), HeapEntry::after);
+                heap_.pop_back();
+                }
+            return false;
+            }
+
+        /*
+        Updates the cached neighbours after slot absorbed was merged into slot survivor.
+        Must be called after the hit centroid of the survivor was updated in the tree.
+        */
+        void merged(int survivor, int absorbed){
+            counters_.merges++;
+            GlobalPoint oldCentroid = centroid(survivor);
+            storeCentroid(survivor);
+            alive_[absorbed] = false;
+            stamp_[absorbed]++;
+            if (bruteForce_) return;
+            if (useGrid_){
+                grid_.remove(absorbed);
+                grid_.move(survivor, centroid(survivor));
+                }
+            visitStamp_++;
+            visited_[survivor] = visitStamp_;
+            rescanRow(survivor);
+            // Rows that had one of the merged nodes as neighbour were within maxr of it
+            auto rescanIfPointingAtMerged = [&](int i){
+                if (visited_[i] == visitStamp_) return;
+                if (nn_[i] == survivor || nn_[i] == absorbed){
+                    visited_[i] = visitStamp_;
+                    rescanRow(i);
+                    }
+                };
+            forEachCandidate(oldCentroid, rescanIfPointingAtMerged);
+            forEachCandidate(centroid(absorbed), rescanIfPointingAtMerged);
+            // The survivor moved; it may now be the closest neighbour of rows around it
+            nearSurvivor_.clear();
+            forEachCandidate(centroid(survivor), [&](int i){
+                if (visited_[i] == visitStamp_) return;
+                visited_[i] = visitStamp_;
+                if (nn_[i] == survivor || nn_[i] == absorbed) rescanRow(i);
+                else nearSurvivor_.push_back(cx_[i], cy_[i], cz_[i], i);
+                });
+            nearSurvivor_.pad();
+            d2_.resize(nearSurvivor_.paddedSize());
+            squaredDistances(centroid(survivor), nearSurvivor_, d2_.data());
+            counters_.distances += nearSurvivor_.size();
+            for (size_t k = 0; k < nearSurvivor_.size(); ++k){
+                int i = nearSurvivor_.tag_[k];
+                float r2 = d2_[k];
+                if (r2 < nnr2_[i] || (r2 == nnr2_[i] && nn_[i] >= 0 && survivor < nn_[i])) setRow(i, survivor, r2);
+                }
+            }
+
+        bool alive(int slot) const { return alive_[slot]; }
+
+        /* Heap memory of the scratch arrays: in use for the current set of nodes, or all held */
+        size_t memoryBytes(bool inUse) const {
+            return vectorBytes(inUse, cx_, cy_, cz_, alive_, nn_, nnr2_, stamp_, visited_, heap_, d2_)
+                + grid_.memoryBytes(inUse) + candidates_.memoryBytes(inUse) + nearSurvivor_.memoryBytes(inUse);
+            }
+
+    private:
+        struct HeapEntry {
+            float r2;
+            int left;
+            int right;
+            int row;
+            unsigned stamp;
+            /* Heap ordering: an entry comes after another one if its (r2, left, right) is larger */
+            static bool after(const HeapEntry& a, const HeapEntry& b){
+                if (a.r2 != b.r2) return a.r2 > b.r2;
+                if (a.left != b.left) return a.left > b.left;
+                return a.right > b.right;
+                }
+            };
+
+        static const int kMinGridSize = 32;
+
+        void storeCentroid(int i){
+            GlobalPoint p = tree_->hitcentroid((*nodes_)[i]);
+            cx_[i] = p.x(); cy_[i] = p.y(); cz_[i] = p.z();
+            }
+
+        GlobalPoint centroid(int i) const { return GlobalPoint(cx_[i], cy_[i], cz_[i]); }
+
+        /* Calls f(slot) for every live slot that can be within maxr of p */
+        template <class F> void forEachCandidate(const GlobalPoint& p, F&& f){
+            if (useGrid_){
+                grid_.forEachNear(p, f);
+                return;
+                }
+            int n = alive_.size();
+            for (int i = 0; i < n; ++i){
+                if (alive_[i]) f(i);
+                }
+            }
+
+        void setRow(int i, int neighbour, float r2){
+            nn_[i] = neighbour;
+            nnr2_[i] = r2;
+            stamp_[i]++;
+            heap_.push_back(HeapEntry{r2, std::min(i, neighbour), std::max(i, neighbour), i, stamp_[i]});
+            std::push_heap(heap_.begin(), heap_.end(), HeapEntry::after);
+            }
+
+        /* Recomputes the nearest live neighbour of slot i; ties go to the lowest slot */
+        void rescanRow(int i){
+            candidates_.clear();
+            forEachCandidate(centroid(i), [&](int j){
+                if (j != i) candidates_.push_back(cx_[j], cy_[j], cz_[j], j);
+                });
+            candidates_.pad();
+            float r2;
+            int k = closestInBlock(centroid(i), candidates_, r2);
+            counters_.distances += candidates_.size();
+            if (k >= 0 && r2 < maxr2_) setRow(i, candidates_.tag_[k], r2);
+            else {
+                nn_[i] = -1;
+                nnr2_[i] = maxr2_;
+                stamp_[i]++;
+                }
+            }
+
+        /* Computes all distances between live slots */
+        bool closestPairBruteForce(int& left, int& right, float& r){
+            bool found = false;
+            float minr2 = maxr2_;
+            int n = alive_.size();
+            for (int i = 0; i < n; ++i){
+                if (!alive_[i]) continue;
+                candidates_.clear();
+                for (int j = i+1; j < n; ++j){
+                    if (alive_[j]) candidates_.push_back(cx_[j], cy_[j], cz_[j], j);
+                    }
+                candidates_.pad();
+                float r2;
+                int k = closestInBlock(centroid(i), candidates_, r2);
+                counters_.distances += candidates_.size();
+                if (k >= 0 && r2 < minr2){
+                    minr2 = r2;
+                    left = i; right = candidates_.tag_[k]; r = std::sqrt(r2);
+                    found = true;
+                    }
+                }
+            return found;
+            }
+
+        bool bruteForce_;
+        SimTree* tree_ = nullptr;
+        const std::pmr::vector<NodeIndex>* nodes_ = nullptr;
+        float maxr2_ = 0.;
+        bool useGrid_ = false;
+        SpatialGrid grid_;     // Live slots, by hit centroid
+        std::vector<float> cx_;     // Hit centroid per slot
+        std::vector<float> cy_;
+        std::vector<float> cz_;
+        std::vector<char> alive_;
+        std::vector<int> nn_;       // Nearest live neighbour per slot (-1 if none within maxr)
+        std::vector<float> nnr2_;   // Squared distance to that neighbour
+        std::vector<unsigned> stamp_;
+        std::vector<unsigned> visited_;
+        unsigned visitStamp_ = 0;
+        std::vector<HeapEntry> heap_;
+        PointBlock candidates_;    // Scratch for rescanRow and the brute force scan
+        PointBlock nearSurvivor_;  // Scratch for merged
+        std::vector<float> d2_;
+        Counters counters_;
+    };
+
+/*
+The merges done by the merging algorithm, in the order in which they were done: the SimTrack
+indices of the surviving and the absorbed node, and the distance between their hit centroids.
+Every node is absorbed at most once, and all merges of a node come after the merges that
+built up the nodes involved.
+*/
+class MergeHistory {
+    public:
+        void clear(){ survivor_.clear(); absorbed_.clear(); distance_.clear(); }
+        void record(uint32_t survivor, uint32_t absorbed, float distance){
+            survivor_.push_back(survivor);
+            absorbed_.push_back(absorbed);
+            distance_.push_back(distance);
+            }
+        /* Appends the merges of another history; only valid if they involve disjoint nodes */
+        void append(const MergeHistory& other){
+            survivor_.insert(survivor_.end(), other.survivor_.begin(), other.survivor_.end());
+            absorbed_.insert(absorbed_.end(), other.absorbed_.begin(), other.absorbed_.end());
+            distance_.insert(distance_.end(), other.distance_.begin(), other.distance_.end());
+            }
+        size_t size() const { return survivor_.size(); }
+        size_t memoryBytes(bool inUse) const { return vectorBytes(inUse, survivor_, absorbed_, distance_); }
+
+        std::vector<uint32_t> survivor_;
+        std::vector<uint32_t> absorbed_;
+        std::vector<float> distance_;
+    };
+
+/*
+mergeable is scratch space owned by the caller, so its capacity is reused between leafparents.
+Every merge is recorded in history, unless that is null.
+*/
+inline bool merge_leafparent_Mar03(
+        SimTree& tree, NodeIndex leafparent, ClusteringEngine& engine,
+        std::pmr::vector<NodeIndex>& mergeable, float maxr=10., MergeHistory* history=nullptr
+        ){
+    SIMMERGER_LOG(kLogMerges, tree.logLevel_) << "  Merging leafparent " << tree.trackid_[leafparent];
+    bool didUpdate = false;
+    // Copy list of potentially mergeable nodes
+    mergeable.clear();
+    tree.takeChildren(leafparent, mergeable);
+    // Parent itself can be mergeable, if it has hits and is not a root
+    if (tree.hasParent(leafparent) && tree.hasHits(leafparent)) mergeable.push_back(leafparent);
+    // Start merging
+    engine.init(tree, mergeable, maxr);
+    int left, right;
+    float r;
+    while(engine.closestPair(left, right, r)){
+        didUpdate = true;
+        // The higher-energy node survives
+        std::pair<int,int> slotsToMerge = (tree.energy_[mergeable[left]] > tree.energy_[mergeable[right]]) ?
+            std::make_pair(left, right) : std::make_pair(right, left);
+        std::pair<NodeIndex,NodeIndex> pairToMerge(mergeable[slotsToMerge.first], mergeable[slotsToMerge.second]);
+        // Now do the merging
+        SIMMERGER_LOG(kLogMerges, tree.logLevel_)
+            << "    Merging " << tree.trackid_[pairToMerge.second]
+            << " into " << tree.trackid_[pairToMerge.first]
+            ;
+        if (history) history->record(tree.track_[pairToMerge.first], tree.track_[pairToMerge.second], r);
+        // Move merged track ids and combine the hit summaries
+        tree.mergeInto(pairToMerge.first, pairToMerge.second);
+        // Move children
+        NodeIndex child = tree.firstChild_[pairToMerge.second];
+        while (child != kNoNode){
+            NodeIndex next = tree.nextSibling_[child];
+            tree.addChild(pairToMerge.first, child);
+            child = next;
+            }
+        tree.clearChildren(pairToMerge.second);
+        // Delete the merged-away node
+        break_from_parent(tree, pairToMerge.second);
+        // Update the hitcentroid for newly merged node, now that it has more hits
+        tree.recomputeHitcentroid(pairToMerge.first);
+        engine.merged(slotsToMerge.first, slotsToMerge.second);
+        }
+    // Keep only the nodes that were not merged away, in their original order
+    size_t nRemaining = 0;
+    for (size_t slot = 0; slot < mergeable.size(); ++slot){
+        if (engine.alive(slot)) mergeable[nRemaining++] = mergeable[slot];
+        }
+    mergeable.resize(nRemaining);
+    // Comma separated track ids of the mergeable nodes, for debugging
+    auto logMergeable = [&](edm::LogVerbatim& log){
+        for (size_t k = 0; k < mergeable.size(); ++k) log << (k ? ", " : "") << tree.trackid_[mergeable[k]];
+        };
+    // All possible merging now done;
+    // Next steps depend on whether the passed node was a root
+    if (!(tree.hasParent(leafparent))){
+        for(auto node : mergeable) tree.addChild(leafparent, node);
+        if(didUpdate) {
+            // Simply overwrite with the merged nodes
+            if (simMergerLogOn(kLogMerges, tree.logLevel_)){
+                edm::LogVerbatim log("SimMerging");
+                log << "    Root " << tree.trackid_[leafparent]
+                    << " is set to have the following children: ";
+                logMergeable(log);
+                }
+            }
+        else{
+            SIMMERGER_LOG(kLogMerges, tree.logLevel_)
+                << "    Root " << tree.trackid_[leafparent]
+                << ": no further merging possible";
+            }
+        return didUpdate;
+        }
+    else {
+        // Special case: If the leafparent had no hits (and was thus not included as
+        // a mergeable node), AND all nodes were merged into one cluster, assign the 
+        // pdgid of the leafparent to the remaining node
+        if(
+            !(tree.hasHits(leafparent))
+            && mergeable.size()==1
+            && tree.pdgid_[mergeable[0]]!=tree.pdgid_[leafparent]
+            ){
+            SIMMERGER_LOG(kLogMerges, tree.logLevel_)
+                << "    Using leafparent pdgid " << tree.pdgid_[leafparent]
+                << " for track " << tree.trackid_[mergeable[0]]
+                << " (rather than " << tree.pdgid_[mergeable[0]]
+                << ") since all nodes were merged into one";
+            tree.pdgid_[mergeable[0]] = tree.pdgid_[leafparent];
+            }
+        // Replace the node in the parent's children list with all merged nodes
+        NodeIndex parent = tree.parent_[leafparent];
+        if (simMergerLogOn(kLogMerges, tree.logLevel_)){
+            edm::LogVerbatim log("SimMerging");
+            log << "    Adding the following children to parent " << tree.trackid_[parent] << ": ";
+            logMergeable(log);
+            }
+        break_from_parent(tree, leafparent);
+        for(auto node : mergeable) tree.addChild(parent, node);
+        return true;
+        }
+    }
+
+/*
+Bottom-up scheduler for merging the leafparents below top.
+Every node keeps a count of its children that are not leaves yet. Leafparents are taken from
+a FIFO worklist; merging a leafparent turns it into leaves below its parent, so the parent
+is enqueued exactly once, when its count drops to zero. The FIFO order visits the nodes by
+height and then in depth-first order, which is the order of the earlier full-tree rescans
+(one rescan per height). top itself is only merged if mergeTop is set.
+Returns the highest level that was merged (leafparents of the original tree are level 0).
+The worklist and scratch come from arena. Nodes closer than maxr are merged; the merges are
+recorded in history, unless that is null.
+*/
+inline int merge_bottom_up_Mar03(
+        SimTree& tree, NodeIndex top, bool mergeTop, ClusteringEngine& engine,
+        std::pmr::memory_resource* arena, float maxr, MergeHistory* history
+        ){
+    std::pmr::vector<NodeIndex> worklist(arena);
+    std::pmr::vector<NodeIndex> mergeable(arena);
+    for (NodeIndex node : tree.subtree(top)){
+        tree.pendingChildren_[node] = 0;
+        tree.mergeLevel_[node] = 0;
+        if (node != top && tree.hasChildren(node)) tree.pendingChildren_[tree.parent_[node]]++;
+        }
+    for (NodeIndex node : tree.subtree(top)){
+        if (tree.hasChildren(node) && tree.pendingChildren_[node] == 0 && (mergeTop || node != top))
+            worklist.push_back(node);
+        }
+    int level = -1;
+    for (size_t next = 0; next < worklist.size(); ++next){
+        NodeIndex leafparent = worklist[next];
+        if (tree.mergeLevel_[leafparent] > level){
+            level = tree.mergeLevel_[leafparent];
+            SIMMERGER_LOG(kLogMerges, tree.logLevel_) << "Level " << level;
+            }
+        NodeIndex parent = tree.parent_[leafparent];
+        merge_leafparent_Mar03(tree, leafparent, engine, mergeable, maxr, history);
+        if (leafparent == top || (parent == top && !mergeTop)) continue;
+        tree.mergeLevel_[parent] = std::max(tree.mergeLevel_[parent], tree.mergeLevel_[leafparent]+1);
+        if (--tree.pendingChildren_[parent] == 0) worklist.push_back(parent);
+        }
+    return level;
+    }
+
+inline void merging_algo_Mar03(
+        SimTree& tree, ClusteringEngine& engine, std::pmr::memory_resource* arena,
+        float maxr, MergeHistory* history
+        ){
+    int level = merge_bottom_up_Mar03(tree, tree.root(), true, engine, arena, maxr, history);
+    SIMMERGER_LOG(kLogMerges, tree.logLevel_) << "Done after level " << level;
+    }
+
+#endif
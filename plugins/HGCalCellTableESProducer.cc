@@ -0,0 +1,40 @@
+#include <memory>
+
+#include "FWCore/Framework/interface/ESProducer.h"
+#include "FWCore/Framework/interface/ModuleFactory.h"
+#include "FWCore/ParameterSet/interface/ParameterSet.h"
+#include "FWCore/ParameterSet/interface/ConfigurationDescriptions.h"
+#include "FWCore/ParameterSet/interface/ParameterSetDescription.h"
+#include "FWCore/Utilities/interface/ESGetToken.h"
+#include "Geometry/Records/interface/CaloGeometryRecord.h"
+#include "Geometry/CaloGeometry/interface/CaloGeometry.h"
+
+#include "SimMerging/SimMerger/interface/HGCalCellTable.h"
+
+/*
+Builds the HGCalCellTable once per CaloGeometry IOV; simmerger and hgcalfinecalontupler
+read it from the CaloGeometryRecord instead of asking RecHitTools for every hit.
+*/
+class HGCalCellTableESProducer : public edm::ESProducer {
+    public:
+        explicit HGCalCellTableESProducer(const edm::ParameterSet&);
+        static void fillDescriptions(edm::ConfigurationDescriptions& descriptions);
+        std::unique_ptr<HGCalCellTable> produce(const CaloGeometryRecord&);
+    private:
+        edm::ESGetToken<CaloGeometry, CaloGeometryRecord> geometryToken_;
+    };
+
+HGCalCellTableESProducer::HGCalCellTableESProducer(const edm::ParameterSet&) :
+    geometryToken_(setWhatProduced(this).consumes())
+    {}
+
+void HGCalCellTableESProducer::fillDescriptions(edm::ConfigurationDescriptions& descriptions) {
+    edm::ParameterSetDescription desc;
+    descriptions.add("hgcalCellTableESProducer", desc);
+    }
+
+std::unique_ptr<HGCalCellTable> HGCalCellTableESProducer::produce(const CaloGeometryRecord& iRecord) {
+    return std::make_unique<HGCalCellTable>(iRecord.get(geometryToken_));
+    }
+
+DEFINE_FWK_EVENTSETUP_MODULE(HGCalCellTableESProducer);
@@ -0,0 +1,96 @@
+#ifndef MergeTrace_h
+#define MergeTrace_h
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <cstdint>
+
+#include "FWCore/Utilities/interface/Exception.h"
+
+/*
+Binary trace of the merging of simmerger (traceFile parameter), for replaying and comparing
+merge decisions offline with python/mergetrace.py.
+The file is a MergeTraceFileHeader followed by one block per event: a MergeTraceEvent, then
+nNodes MergeTraceNode records and nMerges MergeTraceMerge records. All records have a fixed
+size and are written in the native (little-endian) byte order without padding.
+The nodes are those of the trimmed tree, with their hit summaries before any merging; node 0
+is the synthetic root, the parent of all primaries, and is not written. The merges refer to
+the node indices of the survivor and the absorbed node, in merge order. The order of the
+nodes is not fixed, and with streamSubtrees or parallelSubtrees the merges below different
+primaries are interleaved differently than in the serial merging (the merges themselves are
+the same; compare such traces with mergetrace.py diff --unordered).
+Events are written in the order they finish, which with several streams is not the order
+of the input.
+*/
+struct MergeTraceFileHeader {
+    char magic_[4] = {'S', 'M', 'T', 'R'};
+    uint32_t version_ = 1;
+    };
+
+struct MergeTraceEvent {
+    uint64_t event_;
+    uint32_t run_;
+    uint32_t nPCaloHits_;
+    uint32_t nNodes_;
+    uint32_t nMerges_;
+    };
+
+struct MergeTraceNode {
+    uint32_t node_;
+    uint32_t parent_;
+    uint32_t track_;   // Index of the SimTrack in its container
+    int32_t trackId_;
+    int32_t pdgId_;
+    uint32_t nHits_;
+    float energy_;     // Of the SimTrack
+    float x_, y_, z_;  // Hit centroid
+    };
+
+struct MergeTraceMerge {
+    uint32_t survivor_;
+    uint32_t absorbed_;
+    float distance_;
+    };
+
+static_assert(sizeof(MergeTraceFileHeader) == 8 && sizeof(MergeTraceEvent) == 24
+    && sizeof(MergeTraceNode) == 40 && sizeof(MergeTraceMerge) == 12,
+    "The trace records must match python/mergetrace.py");
+
+/* Writes the trace file; write can be called from several streams at once */
+class MergeTraceWriter {
+    public:
+        explicit MergeTraceWriter(const std::string& fileName) :
+            file_(fileName, std::ios::binary | std::ios::trunc)
+            {
+            MergeTraceFileHeader header;
+            file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            if (!file_){
+                throw cms::Exception("SimMerging")
+                    << "Cannot write the merge trace file " << fileName
+                    ;
+                }
+            }
+
+        /* Writes the block of one event; nNodes_ and nMerges_ are taken from nodes and merges */
+        void write(MergeTraceEvent event, const std::vector<MergeTraceNode>& nodes, const std::vector<MergeTraceMerge>& merges){
+            event.nNodes_ = nodes.size();
+            event.nMerges_ = merges.size();
+            std::lock_guard<std::mutex> guard(mutex_);
+            file_.write(reinterpret_cast<const char*>(&event), sizeof(event));
+            file_.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(MergeTraceNode));
+            file_.write(reinterpret_cast<const char*>(merges.data()), merges.size() * sizeof(MergeTraceMerge));
+            }
+
+        void flush(){
+            std::lock_guard<std::mutex> guard(mutex_);
+            file_.flush();
+            }
+
+    private:
+        std::mutex mutex_;
+        std::ofstream file_;
+    };
+
+#endif
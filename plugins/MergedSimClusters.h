@@ -0,0 +1,52 @@
+#ifndef MergedSimClusters_h
+#define MergedSimClusters_h
+
+#include <vector>
+#include <cstddef>
+
+#include "SimDataFormats/CaloAnalysis/interface/SimCluster.h"
+#include "SimDataFormats/CaloAnalysis/interface/SimClusterFwd.h"
+
+/*
+Read access to the compact output of simmerger (compactOutput = True).
+Merged cluster i consists of the source SimClusters (the mix:MergedCaloTruth collection
+simmerger ran on) with keys keys[offsets[i]] ... keys[offsets[i+1]-1], and has pdg id
+pdgIds[i]. Nothing is copied when the view is made; a merged SimCluster is only built when
+asked for, by adding up its source clusters in the same order as the full simmerger output.
+The products and the source collection must outlive the view.
+*/
+class MergedSimClusters {
+    public:
+        MergedSimClusters(
+                const std::vector<unsigned>& offsets,
+                const std::vector<unsigned>& keys,
+                const std::vector<int>& pdgIds,
+                const SimClusterCollection& sources
+                ) :
+            offsets_(offsets), keys_(keys), pdgIds_(pdgIds), sources_(sources)
+            {}
+
+        size_t size() const { return pdgIds_.size(); }
+        int pdgId(size_t i) const { return pdgIds_[i]; }
+
+        /* Number of source SimClusters in merged cluster i, and access to them */
+        size_t nSources(size_t i) const { return offsets_[i+1] - offsets_[i]; }
+        unsigned sourceKey(size_t i, size_t j) const { return keys_[offsets_[i] + j]; }
+        const SimCluster& source(size_t i, size_t j) const { return sources_[sourceKey(i, j)]; }
+
+        /* Builds merged cluster i; identical to the corresponding cluster of the full output */
+        SimCluster materialize(size_t i) const {
+            SimCluster sc;
+            for (size_t j = 0; j < nSources(i); ++j) sc += source(i, j);
+            sc.setPdgId(pdgId(i));
+            return sc;
+            }
+
+    private:
+        const std::vector<unsigned>& offsets_;
+        const std::vector<unsigned>& keys_;
+        const std::vector<int>& pdgIds_;
+        const SimClusterCollection& sources_;
+    };
+
+#endif
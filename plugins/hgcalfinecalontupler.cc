@@ -5,6 +5,7 @@
 #include "FWCore/Framework/interface/MakerMacros.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 #include "FWCore/Utilities/interface/StreamID.h"
+#include "FWCore/Utilities/interface/ESGetToken.h"
 #include "FWCore/PluginManager/interface/ModuleDef.h"
 #include "FWCore/ServiceRegistry/interface/Service.h"
 #include "CommonTools/UtilAlgos/interface/TFileService.h" 
@@ -44,7 +45,7 @@ using std::unordered_map;
 #include "Geometry/CaloGeometry/interface/CaloSubdetectorGeometry.h"
 #include "Geometry/CaloGeometry/interface/TruncatedPyramid.h"
 #include "Geometry/Records/interface/CaloGeometryRecord.h"
-#include "RecoLocalCalo/HGCalRecAlgos/interface/RecHitTools.h"
+#include "SimMerging/SimMerger/interface/HGCalCellTable.h"
 
 template <class T> string typeStr(){return typeid(T).name();}
 template <> string typeStr<bool>(){return "bool";}
@@ -65,12 +66,12 @@ class hgcalfinecalontupler: public edm::one::EDAnalyzer<edm::one::SharedResource
 
         edm::Service<TFileService> fs;
         TTree* tree_;
-        hgcal::RecHitTools hgcalRecHitToolInstance_ ;
         edm::EDGetTokenT<edm::View<PCaloHit>> hgcalEEHitsToken_;
         edm::EDGetTokenT<edm::View<PCaloHit>> hgcalHEfrontHitsToken_;
         edm::EDGetTokenT<edm::View<PCaloHit>> hgcalHEbackHitsToken_;
         edm::EDGetTokenT<edm::SimTrackContainer> tokenSimTracks;
         edm::EDGetTokenT<edm::SimVertexContainer> tokenSimVertices;
+        edm::ESGetToken<HGCalCellTable, CaloGeometryRecord> cellTableToken_;
 
         unordered_map<string, std::any> vectors_;
         unordered_map<string, std::any> scalars_;
@@ -165,7 +166,8 @@ hgcalfinecalontupler::hgcalfinecalontupler(const edm::ParameterSet& iConfig) :
     hgcalHEfrontHitsToken_(consumes<edm::View<PCaloHit>>(edm::InputTag("g4SimHits", "HGCHitsHEfront"))),
     hgcalHEbackHitsToken_(consumes<edm::View<PCaloHit>>(edm::InputTag("g4SimHits", "HGCHitsHEback"))),
     tokenSimTracks(consumes<edm::SimTrackContainer>(edm::InputTag("g4SimHits"))),
-    tokenSimVertices(consumes<edm::SimVertexContainer>(edm::InputTag("g4SimHits")))
+    tokenSimVertices(consumes<edm::SimVertexContainer>(edm::InputTag("g4SimHits"))),
+    cellTableToken_(esConsumes())
     {
         usesResource("TFileService");
         }
@@ -223,9 +225,7 @@ void hgcalfinecalontupler::beginJob() {
 
 void hgcalfinecalontupler::analyze(const edm::Event& iEvent, const edm::EventSetup& iSetup) {
     clear();
-    edm::ESHandle<CaloGeometry> geom;
-    iSetup.get<CaloGeometryRecord>().get(geom);
-    hgcalRecHitToolInstance_.setGeometry(*geom);
+    const HGCalCellTable& cells = iSetup.getData(cellTableToken_);
 
     fillScalar<int>("event_number", iEvent.id().event());
 
@@ -257,11 +257,17 @@ void hgcalfinecalontupler::analyze(const edm::Event& iEvent, const edm::EventSet
         for (auto const & hit : handle->ptrs()) {
             DetId id = hit->id();
             fill<int>("simhit_detid", id.rawId());
-            GlobalPoint position = hgcalRecHitToolInstance_.getPosition(id);
+            uint32_t cell = cells.find(id);
+            if (cell == HGCalCellTable::kNotFound){
+                throw cms::Exception("DoFineCalo")
+                    << "Hit with DetId " << id.rawId()
+                    << " is not in the HGCAL cell table";
+                }
+            GlobalPoint position = cells.position(cell);
             fill<float>("simhit_x", position.x());
             fill<float>("simhit_y", position.y());
             fill<float>("simhit_z", position.z());
-            fill<int>("simhit_layer", hgcalRecHitToolInstance_.getLayer(id));
+            fill<int>("simhit_layer", cells.layer(cell));
             fill<float>("simhit_energy", hit->energy());
             fill<float>("simhit_emenergy", hit->energyEM());
             fill<float>("simhit_time", hit->time());
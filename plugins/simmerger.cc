@@ -1,22 +1,27 @@
 #include <memory>
 #include <vector>
-#include <cstdlib>
-#include <iostream>
-#include <stack>
-#include <unordered_map>
-#include <sstream>
 #include <utility>
-#include <set>
 #include <cmath>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include <array>
+#include <optional>
+#include <memory_resource>
+#include <chrono>
+#include <mutex>
+#include <iomanip>
 using std::vector;
-using std::unordered_map;
 using std::pair;
 
 #include "FWCore/Framework/interface/Frameworkfwd.h"
-#include "FWCore/Framework/interface/stream/EDProducer.h"
+#include "FWCore/Framework/interface/global/EDProducer.h"
 #include "FWCore/Framework/interface/Event.h"
 #include "FWCore/Framework/interface/MakerMacros.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
+#include "FWCore/ParameterSet/interface/ConfigurationDescriptions.h"
+#include "FWCore/ParameterSet/interface/ParameterSetDescription.h"
+#include "FWCore/Utilities/interface/thread_safety_macros.h"
 #include "DataFormats/Common/interface/Ref.h"
 
 #include "SimDataFormats/Track/interface/SimTrack.h"
@@ -25,507 +30,597 @@ using std::pair;
 #include "SimDataFormats/Vertex/interface/SimVertexContainer.h"
 #include "SimDataFormats/CaloAnalysis/interface/SimClusterFwd.h"
 #include "SimDataFormats/CaloAnalysis/interface/SimCluster.h"
+#include "SimMerging/SimMerger/interface/SimTreeMerging.h"
+#include "SimMerging/SimMerger/interface/MergeReplay.h"
 
-#include "RecoLocalCalo/HGCalRecAlgos/interface/RecHitTools.h"
+#include "FWCore/Utilities/interface/ESGetToken.h"
+#include "Geometry/Records/interface/CaloGeometryRecord.h"
+#include "SimMerging/SimMerger/interface/HGCalCellTable.h"
+#include "MergeTrace.h"
 
-#include "DataFormats/Common/interface/Ptr.h"
 #include "DataFormats/Common/interface/View.h"
 #include "SimDataFormats/CaloHit/interface/PCaloHitContainer.h"
 #include "SimDataFormats/CaloHit/interface/PCaloHit.h"
 #include "DataFormats/DetId/interface/DetId.h"
 
-#include <iterator> // For std::forward_iterator_tag
-#include <cstddef>  // For std::ptrdiff_t
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+#include "tbb/enumerable_thread_specific.h"
 
 
-#define EDM_ML_DEBUG
+/*
+Per-event map from the sparse Geant4 track ids to the index of the SimTrack in its container,
+so that everything after this lookup can be done with plain array indexing.
+Track ids are small positive numbers, so normally a direct table over the range of ids is
+used; if the ids are too sparse for that, lookups fall back to a binary search in the sorted
+ids. If a track id occurs more than once, the first SimTrack wins.
+*/
+class TrackIdMap {
+    public:
+        void build(const edm::SimTrackContainer& tracks){
+            table_.clear();
+            sorted_.clear();
+            if (tracks.empty()) return;
+            auto range = std::minmax_element(tracks.begin(), tracks.end(),
+                [](const SimTrack& a, const SimTrack& b){ return a.trackId() < b.trackId(); });
+            minId_ = range.first->trackId();
+            int64_t span = (int64_t)range.second->trackId() - minId_ + 1;
+            if (span <= kMaxSpread * (int64_t)tracks.size() + 1024){
+                table_.assign(span, kNoTrack);
+                for (uint32_t i = tracks.size(); i-- > 0; ) table_[tracks[i].trackId() - minId_] = i;
+                }
+            else {
+                sorted_.reserve(tracks.size());
+                for (uint32_t i = 0; i < tracks.size(); ++i) sorted_.emplace_back(tracks[i].trackId(), i);
+                std::sort(sorted_.begin(), sorted_.end());
+                }
+            }
 
-struct Hit {
-    Hit(float x, float y, float z, float t, float energy, int trackid) :
-        x_(x), y_(y), z_(z), t_(t), energy_(energy), trackid_(trackid) {}
-    ~Hit() {}
-    float x_;
-    float y_;
-    float z_;
-    float t_;
-    float energy_;
-    int trackid_;
-    };
+        /* Index of the SimTrack with this track id, or kNoTrack */
+        uint32_t find(int trackId) const {
+            if (!table_.empty()){
+                int64_t i = (int64_t)trackId - minId_;
+                return (i < 0 || i >= (int64_t)table_.size()) ? kNoTrack : table_[i];
+                }
+            auto it = std::lower_bound(sorted_.begin(), sorted_.end(), std::make_pair(trackId, (uint32_t)0));
+            return (it == sorted_.end() || it->first != trackId) ? kNoTrack : it->second;
+            }
 
-/* Computes the 'average' position of a list of hits */
-GlobalPoint hitcentroid(vector<Hit*> hits){
-    if (hits.size()==0) cms::Exception("SimMerging") << "Cannot compute hit centroid for 0 hits";
-    else if (hits.size()==1) return GlobalPoint(hits[0]->x_, hits[0]->y_, hits[0]->z_);
-    float summedEnergy = 0.;
-    for(auto hit : hits) summedEnergy += hit->energy_;
-    float center_x = 0.f, center_y = 0.f, center_z = 0.f;
-    for(auto hit : hits){
-        float weight = hit->energy_/summedEnergy;
-        center_x += weight * hit->x_;
-        center_y += weight * hit->y_;
-        center_z += weight * hit->z_;
-        }
-    return GlobalPoint(center_x, center_y, center_z);
-    }
+        size_t memoryBytes(bool inUse) const { return vectorBytes(inUse, table_, sorted_); }
 
-class Node {
+    private:
+        static const int64_t kMaxSpread = 8; // Largest id range per track for the direct table
+        int minId_ = 0;
+        vector<uint32_t> table_;
+        vector<pair<int, uint32_t>> sorted_;
+    };
+
+/*
+Per-stream arena for the per-event scratch containers (std::pmr), reset after every event.
+Allocations are served by a monotonic buffer and never freed individually; reset() drops
+everything at once. The initial buffer is grown to the high-water mark of the events seen so
+far, so in steady state an event does not reach malloc at all; release() gives it back. Not thread safe: concurrent
+tasks need an arena each.
+*/
+class EventArena : public std::pmr::memory_resource {
     public:
-        Node() : 
-            trackid_(0), energy_(0.), pdgid_(0), parent_(nullptr),
-            hitcentroidCalculated_(false), hitcentroid_(GlobalPoint(0.f,0.f,0.f))
-            {}
-        Node(int trackid, float energy, int pdgid) :
-            trackid_(trackid), energy_(energy), pdgid_(pdgid), parent_(nullptr),
-            hitcentroidCalculated_(false), hitcentroid_(GlobalPoint(0.f,0.f,0.f))
-            { mergedTrackIds_.push_back(trackid_); }
-        ~Node() {}
-
-        /* Standard depth-first-search tree traversal as an iterator */
-        struct Iterator {
-            using iterator_category = std::forward_iterator_tag;
-            using difference_type   = std::ptrdiff_t;
-            using value_type        = Node;
-            using pointer           = Node*;  // or also value_type*
-            using reference         = Node&;  // or also value_type&
-
-            Iterator(pointer ptr, bool verbose=false) :
-                m_ptr(ptr), root(ptr), depth_(0), verbose_(verbose) {}
-
-            reference operator*() const { return *m_ptr; }
-            pointer operator->() { return m_ptr; }
-
-            Iterator& operator++() {
-                if (m_ptr->hasChildren()){
-                    if (verbose_) edm::LogVerbatim("SimMerging")
-                        << "Track " << m_ptr->trackid_
-                        << ": Going to first child " << m_ptr->children_[0]->trackid_
-                        ;
-                    continuation_.push(m_ptr);
-                    m_ptr = m_ptr->children_[0];
-                    depth_++;
-                    }
-                else {
-                    if (verbose_) edm::LogVerbatim("SimMerging")
-                        << "Track " << m_ptr->trackid_
-                        << ": No children, going to next sibling"
-                        ;
-                    while(true){
-                        if (m_ptr == root){
-                            if (verbose_) edm::LogVerbatim("SimMerging") << "Back at the root of the iterator; quiting";
-                            m_ptr = nullptr;
-                            break;
-                            }
-                        else if (m_ptr->hasNextSibling()){
-                            m_ptr = m_ptr->nextSibling();
-                            if (verbose_) edm::LogVerbatim("SimMerging") << "Has sibling; going to " << m_ptr->trackid_;
-                            break;
-                            }
-                        if (verbose_) edm::LogVerbatim("SimMerging") << "Has no sibling; proceed popping stack";
-                        m_ptr = continuation_.top();
-                        continuation_.pop();
-                        depth_--;
-                        if (verbose_) edm::LogVerbatim("SimMerging") << "Popped back to track " << m_ptr->trackid_;
-                        }
-                    }
-                return *this;
+        EventArena(){ monotonic_.emplace(std::pmr::new_delete_resource()); }
+
+        /*
+        Releases all memory of the event, and grows the buffer to the high-water mark; after
+        release(), frees the buffer instead and starts again from an empty one
+        */
+        void reset(){
+            highWater_ = std::max(highWater_, used_);
+            used_ = 0;
+            monotonic_.reset();
+            if (release_){
+                buffer_ = vector<std::byte>();
+                highWater_ = 0;
+                release_ = false;
                 }
-            // Postfix increment
-            Iterator operator++(int) { Iterator tmp = *this; ++(*this); return tmp; }
-            const int depth(){return depth_;}
-            friend bool operator== (const Iterator& a, const Iterator& b) { return a.m_ptr == b.m_ptr; };
-            friend bool operator!= (const Iterator& a, const Iterator& b) { return a.m_ptr != b.m_ptr; };  
-            private:
-                pointer m_ptr;
-                pointer root;
-                int depth_;
-                bool verbose_;
-                std::stack<pointer> continuation_;
+            else if (buffer_.size() < highWater_) buffer_.resize(highWater_);
+            if (buffer_.empty()) monotonic_.emplace(std::pmr::new_delete_resource());
+            else monotonic_.emplace(buffer_.data(), buffer_.size(), std::pmr::new_delete_resource());
+            }
+
+        /* Makes the next reset() free the buffer; the containers of the event stay valid until then */
+        void release(){ release_ = true; }
+
+        /* Releases the arena when going out of scope, also if the event throws */
+        struct Scope {
+            EventArena& arena;
+            explicit Scope(EventArena& a) : arena(a) {}
+            ~Scope(){ arena.reset(); }
             };
-        Iterator begin(bool verbose=false) { return Iterator(this, verbose); }
-        Iterator end() { return Iterator(nullptr); }
-
-        /* Traverses upwards */
-        struct IteratorUp {
-            using iterator_category = std::forward_iterator_tag;
-            using difference_type   = std::ptrdiff_t;
-            using value_type        = Node;
-            using pointer           = Node*;  // or also value_type*
-            using reference         = Node&;  // or also value_type&
-            IteratorUp(pointer ptr) : m_ptr(ptr) {}
-            reference operator*() const { return *m_ptr; }
-            pointer operator->() { return m_ptr; }
-            IteratorUp& operator++() {
-                m_ptr = (m_ptr->hasParent()) ? m_ptr->parent_ : nullptr ;
-                return *this;
+
+        size_t used() const { return used_; }
+        size_t highWater() const { return std::max(highWater_, used_); }
+        size_t capacity() const { return buffer_.size(); }
+        /* Bytes of the current event, or the size the buffer will have after the next reset */
+        size_t memoryBytes(bool inUse) const {
+            if (inUse) return used_;
+            return release_ ? 0 : std::max(buffer_.size(), highWater());
+            }
+
+    private:
+        // Count the worst-case alignment padding too, so a buffer of highWater_ bytes always suffices
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            used_ += bytes + alignment - 1;
+            return monotonic_->allocate(bytes, alignment);
+            }
+        void do_deallocate(void*, size_t, size_t) override {}
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+        vector<std::byte> buffer_;
+        std::optional<std::pmr::monotonic_buffer_resource> monotonic_;
+        size_t used_ = 0;     // Bytes allocated in the current event
+        size_t highWater_ = 0;
+        bool release_ = false;
+    };
+
+/*
+Combines the PCaloHits of one track in one cell into a single Hit in the tree: the energies
+are summed and the time is the energy-weighted mean time. The position of the cell is the
+same for all of them, so the hit centroids are unchanged up to float rounding (the energies
+are summed in double precision, but stored as floats); only fewer hits are stored.
+Hits are found by (cell, track id) in an open addressing hash table that keeps its capacity
+between events.
+*/
+class HitAggregator {
+    public:
+        /* Starts a new event with at most nHits input hits */
+        void clear(size_t nHits){
+            size_t capacity = 16;
+            while (capacity < 2*nHits) capacity *= 2;
+            mask_ = capacity-1;
+            tableKeys_.assign(capacity, kEmptyKey);
+            tableHits_.resize(capacity);
+            sumE_.clear();
+            sumEt_.clear();
+            nInput_ = 0;
+            }
+
+        /* Adds a hit in the given cell (any dense cell index) to the tree, or to its earlier twin */
+        void add(SimTree& tree, uint32_t cell, float x, float y, float z, float t, float energy, uint32_t track){
+            nInput_++;
+            uint64_t key = ((uint64_t)cell << 32) | track;
+            size_t slot = hash(key);
+            while (tableKeys_[slot] != key && tableKeys_[slot] != kEmptyKey) slot = (slot+1) & mask_;
+            if (tableKeys_[slot] == kEmptyKey){
+                tableKeys_[slot] = key;
+                tableHits_[slot] = tree.addHit(x, y, z, t, energy, track);
+                sumE_.push_back(0.);
+                sumEt_.push_back(0.);
                 }
-            IteratorUp operator++(int) { IteratorUp tmp = *this; ++(*this); return tmp; }
-            friend bool operator== (const IteratorUp& a, const IteratorUp& b) { return a.m_ptr == b.m_ptr; };
-            friend bool operator!= (const IteratorUp& a, const IteratorUp& b) { return a.m_ptr != b.m_ptr; };  
-            private: pointer m_ptr;
-            };
-        IteratorUp begin_up() { return IteratorUp(this); }
-        IteratorUp end_up() { return IteratorUp(nullptr); }
-
-        void setParent(Node* parent) {parent_ = parent;}
-        void addChild(Node* child) {children_.push_back(child);}
-        void addHit(Hit* hit) {hits_.push_back(hit);}
-        int nhits(){ return hits_.size(); }
-        bool hasHits(){ return nhits() > 0; }
-        bool isLeaf(){ return children_.empty(); }
-        bool hasChildren(){ return !(children_.empty()); }
-        bool hasParent(){ return parent_ != nullptr; }
-
-        bool hasNextSibling(){
-            if (!parent_){
-                // There is no parent
-                return false;
+            uint32_t aggregated = tableHits_[slot];
+            sumE_[aggregated] += energy;
+            sumEt_[aggregated] += (double)energy * t;
+            }
+
+        /* Stores the summed energies and mean times in the hits of the tree */
+        void finish(SimTree& tree){
+            for (uint32_t ihit = 0; ihit < sumE_.size(); ++ihit){
+                tree.hitE_[ihit] = sumE_[ihit];
+                if (sumE_[ihit] > 0.) tree.hitT_[ihit] = sumEt_[ihit] / sumE_[ihit];
                 }
-            else if (parent_->children_.back() == this){
-                // This was the last child
-                return false;
+            }
+
+        size_t nInput() const { return nInput_; }
+        size_t nOutput() const { return sumE_.size(); }
+        size_t memoryBytes(bool inUse) const { return vectorBytes(inUse, tableKeys_, tableHits_, sumE_, sumEt_); }
+
+    private:
+        static constexpr uint64_t kEmptyKey = std::numeric_limits<uint64_t>::max();
+
+        size_t hash(uint64_t k) const { return (size_t)((k * 0x9E3779B97F4A7C15ULL) >> 20) & mask_; }
+
+        size_t mask_ = 0;
+        vector<uint64_t> tableKeys_;
+        vector<uint32_t> tableHits_;
+        vector<double> sumE_;   // Per aggregated hit
+        vector<double> sumEt_;
+        size_t nInput_ = 0;
+    };
+
+/*
+Which SimTracks of an event get a node in the trimmed tree, and how those nodes are linked.
+Only tracks with hits and their ancestors are kept. Chains of intermediate tracks
+(no hits, a single kept child) are collapsed right away: the end of the chain becomes a child
+of the first ancestor that is not intermediate. The children of a node are its direct kept
+children in SimTrack order, followed by the ends of the chains starting below it, in the
+SimTrack order of the first track of the chain.
+trackIndex must have been built from tracks; trackHasHits flags the SimTrack indices that
+own at least one hit. All bookkeeping is per SimTrack index, and the nodes remember the index
+of their SimTrack. The arrays come from arena.
+*/
+class TrimmedForest {
+    public:
+        TrimmedForest(
+                const edm::SimTrackContainer& tracks,
+                const edm::SimVertexContainer& vertices,
+                const TrackIdMap& trackIndex,
+                const vector<bool>& trackHasHits,
+                std::pmr::memory_resource* arena
+                ) :
+            tracks_(tracks), trackHasHits_(trackHasHits),
+            parent_(tracks.size(), kNoTrack, arena), keep_(tracks.size(), false, arena),
+            nKeptChildren_(tracks.size(), 0, arena), keptChild_(tracks.size(), kNoTrack, arena),
+            keptTracks_(arena), trackNode_(tracks.size(), kNoNode, arena)
+            {
+            size_t nTracks = tracks.size();
+            // Parent track of every track; have to get the parent info via the SimVertex
+            for (uint32_t i = 0; i < nTracks; ++i){
+                const SimVertex& vertex = vertices.at(tracks[i].vertIndex());
+                if (vertex.noParent()) continue;
+                int parentid = vertex.parentIndex();
+                parent_[i] = trackIndex.find(parentid);
+                if (parent_[i] == kNoTrack){
+                    throw cms::Exception("Unknown")
+                        << "Track id " << parentid
+                        << " is not in the map"
+                        ;
+                    }
                 }
-            // else if ( (int)(parent_->children_.size()-1) == iChild_){
-            //     // This was the last child
-            //     return false;
-            //     }
-            return true;
-            }
-
-        Node* nextSibling(){
-            if (hasNextSibling()){
-                vector<Node*>::iterator sibling = std::find(
-                    parent_->children_.begin(), parent_->children_.end(), this
-                    );
-                sibling++; // advance once
-                if (sibling == parent_->children_.end())
-                    // This shouldn't happen
-                    return nullptr;
-                return *sibling;
+            // Keep the tracks with hits and all their ancestors
+            for (uint32_t i = 0; i < nTracks; ++i){
+                if (!trackHasHits[i]) continue;
+                for (uint32_t t = i; t != kNoTrack && !keep_[t]; t = parent_[t]) keep_[t] = true;
                 }
-            return nullptr;
-            }
-
-        /* Traverses tree and builds string representation */
-        std::string stringrep(){
-            std::stringstream ss;
-            int nTracks = 0;
-            int nHits = 0;
-            for (Node::Iterator it = begin(); it != end(); it++){
-                Node& node = (*it);
-                for (int i = 0; i < it.depth(); ++i){
-                    ss << "--";
-                    }
-                ss
-                    << "Track " << node.trackid_
-                    << " (" << node.nhits() << " hits)"
-                    << "\n";
-                nTracks++;
-                nHits += node.nhits();
+            for (uint32_t i = 0; i < nTracks; ++i){
+                if (!keep_[i]) continue;
+                keptTracks_.push_back(i);
+                if (parent_[i] == kNoTrack) continue;
+                nKeptChildren_[parent_[i]]++;
+                keptChild_[parent_[i]] = i;
                 }
-            ss << "In total " << nTracks << " tracks with " << nHits << " hits";
-            return ss.str();
             }
 
-        /* A node is a 'leaf parent' if it has children, and all those children are leafs  */
-        bool isLeafParent(){
-            // A leaf itself is not a leaf parent
-            if (isLeaf()) return false;
-            for(auto child : children_){
-                if (child->hasChildren()) return false;
-                }
-            return true;
-            }
+        /* The kept SimTracks, in SimTrack order */
+        const std::pmr::vector<uint32_t>& keptTracks() const { return keptTracks_; }
+        uint32_t parent(uint32_t i) const { return parent_[i]; }
+        bool isIntermediate(uint32_t i) const { return !trackHasHits_[i] && nKeptChildren_[i] == 1; }
 
-        /* Uses a boolean as a guard against unnecessarily recomputing the hit centroid */
-        GlobalPoint hitcentroid(){
-            if (hitcentroidCalculated_) return hitcentroid_;
-            return recomputeHitcentroid();
-            }
+        /*
+        Creates the nodes of the kept SimTracks [begin, end) (in SimTrack order), gives them
+        their hits and links them; those without a kept parent become children of anchor.
+        The hits of the tree must be sorted; the group of SimTrack i is groupOfTrack[i], or i
+        itself if groupOfTrack is null. The parents of all tracks must be in the range too.
+        */
+        void addNodes(
+                SimTree& tree, const uint32_t* begin, const uint32_t* end, NodeIndex anchor,
+                const uint32_t* groupOfTrack=nullptr
+                ){
+            for (const uint32_t* it = begin; it != end; ++it){
+                uint32_t i = *it;
+                if (isIntermediate(i)) continue;
+                trackNode_[i] = tree.addNode(tracks_[i].trackId(), tracks_[i].momentum().E(), tracks_[i].type(), i);
+                tree.setHits(trackNode_[i], groupOfTrack ? groupOfTrack[i] : i);
+                }
 
-        /* Force recomputes the hit centroid */
-        GlobalPoint recomputeHitcentroid(){
-            hitcentroid_ = ::hitcentroid(hits_);
-            hitcentroidCalculated_ = true;
-            return hitcentroid_;
+            // Link the direct children first, then the ends of the collapsed chains
+            auto parentNode = [&](uint32_t i){ return parent_[i] == kNoTrack ? anchor : trackNode_[parent_[i]]; };
+            for (const uint32_t* it = begin; it != end; ++it){
+                uint32_t i = *it;
+                if (isIntermediate(i)) continue;
+                if (parent_[i] != kNoTrack && isIntermediate(parent_[i])) continue;
+                SIMMERGER_LOG(kLogTree, tree.logLevel_)
+                    << "Setting parent->child relationship: "
+                    << tree.trackid_[parentNode(i)] << " -> " << tracks_[i].trackId()
+                    ;
+                tree.addChild(parentNode(i), trackNode_[i]);
+                }
+            for (const uint32_t* it = begin; it != end; ++it){
+                uint32_t i = *it;
+                if (!isIntermediate(i)) continue;
+                if (parent_[i] != kNoTrack && isIntermediate(parent_[i])) continue;
+                uint32_t last = i;
+                while (isIntermediate(last)) last = keptChild_[last];
+                SIMMERGER_LOG(kLogTree, tree.logLevel_)
+                    << "Collapsing intermediate tracks: "
+                    << tree.trackid_[parentNode(i)] << " -> " << tracks_[i].trackId()
+                    << " -> ... -> " << tracks_[last].trackId()
+                    ;
+                tree.addChild(parentNode(i), trackNode_[last]);
+                }
             }
 
-        int trackid_;
-        float energy_;
-        int pdgid_;
-        Node * parent_;
-        vector<Node*> children_;
-        vector<int> mergedTrackIds_;
-        vector<Hit*> hits_;
-        bool hitcentroidCalculated_;
-        GlobalPoint hitcentroid_;
+    private:
+        const edm::SimTrackContainer& tracks_;
+        const vector<bool>& trackHasHits_;
+        std::pmr::vector<uint32_t> parent_;
+        std::pmr::vector<char> keep_;
+        std::pmr::vector<uint32_t> nKeptChildren_;
+        std::pmr::vector<uint32_t> keptChild_;
+        std::pmr::vector<uint32_t> keptTracks_;
+        std::pmr::vector<NodeIndex> trackNode_; // Of the tracks of the last addNodes
     };
 
-/* Remove a node from its parent's children vector */
-void break_from_parent(Node* node){
-    if (!(node->hasParent())) cms::Exception("SimMerging") << "Cannot remove root node";
-    vector<Node*>& parents_children = node->parent_->children_;
-    // erase-remove idiom: https://en.wikipedia.org/wiki/Erase%E2%80%93remove_idiom#Example
-    parents_children.erase(
-        std::remove(parents_children.begin(), parents_children.end(), node),
-        parents_children.end()
-        );
+/*
+Builds the trimmed SimTrack tree (see TrimmedForest) from the SimTracks and the hits already
+stored in the tree. The scratch arrays come from arena.
+*/
+void build_trimmed_tree(
+        SimTree& tree,
+        const edm::SimTrackContainer& tracks,
+        const edm::SimVertexContainer& vertices,
+        const TrackIdMap& trackIndex,
+        const vector<bool>& trackHasHits,
+        std::pmr::memory_resource* arena
+        ){
+    TrimmedForest forest(tracks, vertices, trackIndex, trackHasHits, arena);
+    const std::pmr::vector<uint32_t>& kept = forest.keptTracks();
+    // Create the nodes and give them their (contiguous) hits
+    tree.reserve(kept.size()+1, tree.nHitsTotal());
+    tree.sortHits(tracks.size());
+    forest.addNodes(tree, kept.data(), kept.data() + kept.size(), tree.root());
     }
 
-/* Breaks node from parent but moves its children to the children of the parent */
-void remove_intermediate_node(Node* node){
-    Node* parent = node->parent_;
-    break_from_parent(node);
-    // Move children of the now-removed node to its parent
-    for (auto child : node->children_){
-        parent->addChild(child);
-        child->setParent(parent);
+/*
+Intra-event parallel version of merging_algo_Mar03.
+The subtrees below the children of the root are disjoint, and until they are fully collapsed
+they only interact through the children list of the root. Every such subtree is moved below a
+private anchor node and collapsed in its own TBB task, with a clustering engine from engines
+and an arena from arenas as per-thread scratch (the tasks never wait, so a thread cannot run
+two of them at once). The merges of the subtrees are recorded in per-thread histories, and
+added to history before the merging at the root.
+The collapsed subtrees are then appended to the root in the order the serial algorithm would
+have produced: by the level at which they were collapsed, then by original position.
+Merging at the root itself is done serially afterwards, so the output is identical.
+*/
+void merging_algo_Mar03_parallel(
+        SimTree& tree, ClusteringEngine& engine, EventArena& arena, float maxr, MergeHistory* history,
+        tbb::enumerable_thread_specific<ClusteringEngine>& engines,
+        tbb::enumerable_thread_specific<EventArena>& arenas,
+        tbb::enumerable_thread_specific<MergeHistory>& histories
+        ){
+    NodeIndex root = tree.root();
+    std::pmr::vector<NodeIndex> tops(&arena);
+    for (NodeIndex child = tree.firstChild_[root]; child != kNoNode; child = tree.nextSibling_[child]){
+        if (tree.hasChildren(child)) tops.push_back(child);
         }
+    if (tops.size() < 2){
+        merging_algo_Mar03(tree, engine, &arena, maxr, history);
+        return;
+        }
+    SIMMERGER_LOG(kLogMerges, tree.logLevel_) << "Collapsing " << tops.size() << " subtrees in parallel";
+    std::pmr::vector<NodeIndex> anchors(tops.size(), &arena);
+    for (size_t i = 0; i < tops.size(); ++i){
+        anchors[i] = tree.addNode(0, 0., 0);
+        break_from_parent(tree, tops[i]);
+        tree.addChild(anchors[i], tops[i]);
+        }
+    std::pmr::vector<int> collapsedIn(tops.size(), &arena);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, tops.size(), 1), [&](const tbb::blocked_range<size_t>& range){
+        ClusteringEngine& local = engines.local();
+        EventArena& localArena = arenas.local();
+        MergeHistory* localHistory = history ? &histories.local() : nullptr;
+        for (size_t i = range.begin(); i != range.end(); ++i){
+            collapsedIn[i] = merge_bottom_up_Mar03(tree, anchors[i], false, local, &localArena, maxr, localHistory);
+            }
+        });
+    std::pmr::vector<size_t> order(tops.size(), &arena);
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b){ return collapsedIn[a] < collapsedIn[b]; });
+    std::pmr::vector<NodeIndex> collapsed(&arena);
+    for (size_t i : order){
+        collapsed.clear();
+        tree.takeChildren(anchors[i], collapsed);
+        for (auto node : collapsed) tree.addChild(root, node);
+        }
+    for (EventArena& local : arenas) local.reset();
+    for (MergeHistory& local : histories){
+        if (history) history->append(local);
+        local.clear();
+        }
+    merging_algo_Mar03(tree, engine, &arena, maxr, history);
     }
 
 // _______________________________________________
-// Some functions for traversal by recursion
-// These first build the whole traversal in a vector
-// (as pointers, so memory usage is not too bad)
-
-/* Does depth first search traversal by using recursion, but not as an iterator */
-void _dfs_recursion(
-        Node* node,
-        vector<pair<Node*, int>>& returnable,
-        int depth
-        )
-    {
-    returnable.push_back(std::make_pair(node, depth));
-    for (auto child : node->children_){
-        _dfs_recursion(child, returnable, depth+1);
-        }
-    }
+
 
 /*
-Wrapper around the recursive version that only takes a node as input.
-Returns a vector of pair<node, depth>.
-Useful if you want to keep the whole traversal in memory; usually you
-will want to use the iterator version of the Node class.
+Wall time per stage and work counters of one event, for the instrumentation of simmerger.
+Nodes are counted after trimming (the SimTracks are the nodes before trimming). Of the
+PCaloHits, dropped are removed by the prefilter and selected go into the tree (or into the
+aggregation); hits are the hits in the tree, after aggregation. The leafparents, iterations,
+distances and merges are summed over all clustering engines used in the event; skipped is 1
+for an event dropped by skipOversizedEvents, so its mean is the fraction of skipped events.
 */
-vector<pair<Node*, int>> dfs(Node* root){
-    vector<pair<Node*, int>> returnable;
-    _dfs_recursion(root, returnable, 0);
-    return returnable;
-    }
-
-/* String representation of dfs traversal (keeps whole traversal in memory) */
-std::string dfs_stringrep(Node* root){
-    std::stringstream ss;
-    for (auto node_depth_pair : dfs(root)){
-        for (int i = 0; i < node_depth_pair.second; ++i){
-            ss << "--";
-            }
-        ss
-            << "Track " << node_depth_pair.first->trackid_
-            << " (" << node_depth_pair.first->nhits() << " hits)"
-            << "\n";
+struct SimMergerStats {
+    enum Stage { kIngest, kBuild, kMerge, kOutput, kNStages };
+    enum Counter { kPCaloHits, kDropped, kSelected, kHits, kSimTracks, kNodes, kLeafparents, kIterations, kDistances, kMerges, kSkipped, kNCounters };
+    static constexpr const char* kStageNames[kNStages] = {"ingest", "build", "merge", "output"};
+    static constexpr const char* kCounterNames[kNCounters] = {
+        "PCaloHits", "dropped", "selected", "hits", "SimTracks", "nodes", "leafparents", "iterations", "distances", "merges", "skipped"
+        };
+    double total() const {
+        double sum = 0.;
+        for (double t : time_) sum += t;
+        return sum;
         }
-    return ss.str();
-    }
+    void addEngine(const ClusteringEngine& engine){
+        count_[kLeafparents] += engine.counters().inits;
+        count_[kIterations] += engine.counters().iterations;
+        count_[kDistances] += engine.counters().distances;
+        count_[kMerges] += engine.counters().merges;
+        }
+    double time_[kNStages] = {}; // ms
+    double count_[kNCounters] = {};
+    };
 
-/* Remove single-child no-hit tracks (i.e. intermediate tracks) */
-void trim_tree(Node* root){
-    // Traverse once and note all tracks that should be kept:
-    // Either a track that has hits, or an ancestor thereof
-    std::set<int> trackids_with_hits_or_parents_thereof;
-    for (auto& node : *root){
-        if (!(node.hasHits())) continue;
-        // Iterate upwards and save in the set
-        for (auto it=node.begin_up(); it!=node.end_up(); it++){
-            trackids_with_hits_or_parents_thereof.insert(it->trackid_);
-            }
-        }
-    // Now remove all nodes not in the set
-    // We'll be modifying parent-child relationships mid-loop, so we have to be a little
-    // careful
-    auto it=root->begin();
-    while(it!=root->end()){
-        Node& node = (*it);
-        if (!(trackids_with_hits_or_parents_thereof.count(node.trackid_))){
-            // First remove children so the iterator will go to the next sibling
-            node.children_.clear();
-            // Advance to next sibling (or further up the chain)
-            it++;
-            // Then break from parent (if doing this before advancing the order gets messed up)
-            break_from_parent(&node);
-            }
-        else{
-            it++;
-            }
-        }
-    // // Debug printout
-    // edm::LogVerbatim("SimMerging") << "Printing root " << root->trackid_ << " after step1 trimming";
-    // edm::LogVerbatim("SimMerging") << root->stringrep();
-    // Second trimming step: Remove 'intermediate' tracks
-    // (i.e. tracks with no hits, 1 child, and 1 parent)
-    // In this case it's easier to put the whole traversal in memory first,
-    // and avoid modifying relationships mid-loop
-    for (auto node_depth_pair : dfs(root)){
-        Node* node = node_depth_pair.first;
-        if (node->hasParent() && (node->children_.size()==1) && !(node->hasHits())){
-            remove_intermediate_node(node);
+/*
+Adds the wall time since the previous lap (or the construction) to a stage of stats.
+Does nothing, not even reading the clock, if stats is null.
+*/
+class StageClock {
+    public:
+        explicit StageClock(SimMergerStats* stats) : stats_(stats) {
+            if (stats_) last_ = std::chrono::steady_clock::now();
+            }
+        void lap(SimMergerStats::Stage stage){
+            if (!stats_) return;
+            auto now = std::chrono::steady_clock::now();
+            stats_->time_[stage] += std::chrono::duration<double, std::milli>(now - last_).count();
+            last_ = now;
             }
+        SimMergerStats* stats() const { return stats_; }
+    private:
+        SimMergerStats* stats_;
+        std::chrono::steady_clock::time_point last_;
+    };
+
+/*
+Logs the mean, percentiles and maximum of every stage time and counter over the events, and
+a histogram of the total time per event in powers of two of a millisecond.
+*/
+void logStatsSummary(const vector<SimMergerStats>& events){
+    if (events.empty()) return;
+    size_t n = events.size();
+    edm::LogVerbatim log("SimMerging");
+    log << "simmerger instrumentation, " << n << " events\n"
+        << std::setw(16) << "" << std::setw(12) << "mean" << std::setw(12) << "p50"
+        << std::setw(12) << "p90" << std::setw(12) << "p99" << std::setw(12) << "max" << "\n";
+    vector<double> values(n);
+    auto logRow = [&](const std::string& name){
+        std::sort(values.begin(), values.end());
+        double mean = 0.;
+        for (double v : values) mean += v / n;
+        auto percentile = [&](double q){ return values[std::min(n-1, (size_t)(q * n))]; };
+        log << std::setw(16) << std::left << name << std::right << std::setprecision(4)
+            << std::setw(12) << mean << std::setw(12) << percentile(.5) << std::setw(12) << percentile(.9)
+            << std::setw(12) << percentile(.99) << std::setw(12) << values.back() << "\n";
+        };
+    for (int stage = 0; stage < SimMergerStats::kNStages; ++stage){
+        for (size_t i = 0; i < n; ++i) values[i] = events[i].time_[stage];
+        logRow(std::string(SimMergerStats::kStageNames[stage]) + " [ms]");
+        }
+    for (size_t i = 0; i < n; ++i) values[i] = events[i].total();
+    logRow("total [ms]");
+    for (int counter = 0; counter < SimMergerStats::kNCounters; ++counter){
+        for (size_t i = 0; i < n; ++i) values[i] = events[i].count_[counter];
+        logRow(SimMergerStats::kCounterNames[counter]);
+        }
+    // Bin k holds the events with a total time in [2^(k-11), 2^(k-10)) ms; bin 0 also
+    // everything faster
+    std::array<size_t, 32> histogram{};
+    for (const SimMergerStats& event : events){
+        int k = (int)std::floor(std::log2(std::max(event.total(), 1e-9))) + 11;
+        histogram[std::clamp(k, 0, (int)histogram.size()-1)]++;
+        }
+    size_t maxCount = *std::max_element(histogram.begin(), histogram.end());
+    log << "Total time per event:";
+    for (size_t k = 0; k < histogram.size(); ++k){
+        if (!histogram[k]) continue;
+        log << "\n" << std::setw(12) << std::ldexp(1., (int)k-11) << " ms " << std::setw(8) << histogram[k] << " "
+            << std::string((histogram[k] * 50 + maxCount - 1) / maxCount, '#');
         }
     }
 
-
-/* Compute a distance measure between two nodes: now simply distance between the hit centroids */
-float distance(Node* left, Node* right){
-    GlobalPoint p1 = left->hitcentroid(), p2 = right->hitcentroid();
-    return std::sqrt(
-        std::pow(p1.x()-p2.x(),2) + std::pow(p1.y()-p2.y(),2) + std::pow(p1.z()-p2.z(),2)
-        );
+/* Trace record of a node of the tree, with its hit centroid */
+MergeTraceNode traceNode(SimTree& tree, NodeIndex node){
+    GlobalPoint centroid = tree.hitcentroid(node);
+    return MergeTraceNode{
+        node, tree.parent_[node], tree.track_[node], tree.trackid_[node], tree.pdgid_[node],
+        (uint32_t)tree.nhits(node), tree.energy_[node], centroid.x(), centroid.y(), centroid.z()
+        };
     }
 
-bool merge_leafparent_Mar03(Node* leafparent, float maxr=10.){
-    edm::LogVerbatim("SimMerging") << "  Merging leafparent " << leafparent->trackid_;
-    bool didUpdate = false;
-    // Copy list of potentially mergeable nodes
-    vector<Node*> mergeable = leafparent->children_;
-    leafparent->children_.clear();
-    // Parent itself can be mergeable, if it has hits and is not a root
-    if (leafparent->hasParent() && leafparent->hasHits()) mergeable.push_back(leafparent);
-    // Start merging
-    while(true){
-        bool didUpdateThisIteration = false;
-        float minr = maxr;
-        pair<Node*,Node*> pairToMerge;
-        // Compute all distances between clusters
-        int nMergeable = mergeable.size();
-        for (int i = 0; i < nMergeable; ++i){
-            Node* left = mergeable[i];
-            for (int j = i+1; j < nMergeable; ++j){
-                Node* right = mergeable[j];
-                float r = distance(left, right);
-                if (r < minr){
-                    minr = r;
-                    pairToMerge = (left->energy_ > right->energy_) ?
-                        std::make_pair(left, right) : std::make_pair(right, left);
-                    didUpdate = true;
-                    didUpdateThisIteration = true;
-                    }
-                }
-            }
-        if (!didUpdateThisIteration) break; // Nothing to merge this iteration
-        // Now do the merging
-        edm::LogVerbatim("SimMerging")
-            << "    Merging " << pairToMerge.second->trackid_
-            << " into " << pairToMerge.first->trackid_
-            ;
-        // Bookkeep that the track (and any previously merged tracks) is merged in
-        for (auto trackid : pairToMerge.second->mergedTrackIds_){
-            pairToMerge.first->mergedTrackIds_.push_back(trackid);
-            }
-        // Move children
-        for(auto child : pairToMerge.second->children_){
-            pairToMerge.first->addChild(child);
-            child->setParent(pairToMerge.first);
-            }
-        pairToMerge.second->children_.clear();
-        // Move hits
-        for(auto hit : pairToMerge.second->hits_) pairToMerge.first->addHit(hit);
-        pairToMerge.second->hits_.clear();
-        // Delete the merged-away node
-        break_from_parent(pairToMerge.second);
-        mergeable.erase(
-            std::remove(mergeable.begin(), mergeable.end(), pairToMerge.second),
-            mergeable.end()
-            );
-        // Recompute the hitcentroid for newly merged node, now that it has more hits
-        pairToMerge.first->recomputeHitcentroid();
-        }
-    // Make a string representation of the mergeable nodes for debugging
-    std::string mergeableStr = "";
-    if(mergeable.size()){
-        std::stringstream ss;
-        for(auto child : mergeable) ss << child->trackid_ << ", ";
-        mergeableStr = ss.str();
-        mergeableStr.pop_back(); mergeableStr.pop_back(); // Remove trailing comma
-        }
-    // All possible merging now done;
-    // Next steps depend on whether the passed node was a root
-    if (!(leafparent->hasParent())){
-        leafparent->children_ = mergeable;
-        if(didUpdate) {
-            // Simply overwrite with the merged nodes
-            edm::LogVerbatim("SimMerging")
-                << "    Root " << leafparent->trackid_
-                << " is set to have the following children: "
-                << mergeableStr;
-            }
-        else{
-            edm::LogVerbatim("SimMerging")
-                << "    Root " << leafparent->trackid_
-                << ": no further merging possible";
-            }
-        return didUpdate;
-        }
-    else {
-        // Special case: If the leafparent had no hits (and was thus not included as
-        // a mergeable node), AND all nodes were merged into one cluster, assign the 
-        // pdgid of the leafparent to the remaining node
-        if(
-            !(leafparent->hasHits())
-            && mergeable.size()==1
-            && mergeable[0]->pdgid_!=leafparent->pdgid_
-            ){
-            edm::LogVerbatim("SimMerging")
-                << "    Using leafparent pdgid " << leafparent->pdgid_
-                << " for track " << mergeable[0]->trackid_
-                << " (rather than " << mergeable[0]->pdgid_
-                << ") since all nodes were merged into one";
-            mergeable[0]->pdgid_ = leafparent->pdgid_;
-            }
-        // Replace the node in the parent's children list with all merged nodes
-        Node* parent = leafparent->parent_;
-        edm::LogVerbatim("SimMerging")
-            << "    Adding the following children to parent " << parent->trackid_
-            << ": " << mergeableStr;
-        break_from_parent(leafparent);
-        for(auto child : mergeable){
-            parent->addChild(child);
-            child->setParent(parent);
-            }
-        return true;
-        }
-    }
+/*
+Per-stream scratch of simmerger. Everything in here is only used within one event, but it
+keeps its capacity between the events of a stream.
+*/
+struct SimMergerStreamCache {
+    explicit SimMergerStreamCache(bool bruteForceMerging) :
+        bruteForceMerging_(bruteForceMerging),
+        engine_(bruteForceMerging),
+        subtreeEngines_(ClusteringEngine(bruteForceMerging))
+        {}
 
-void merging_algo_Mar03(Node* root){
-    int iIteration = -1;
-    bool didUpdate = true;
-    while(didUpdate){
-        iIteration++;
-        edm::LogVerbatim("SimMerging") << "Iteration " << iIteration;
-        // Build list of leaf parents in memory
-        vector<Node*> leafparents;
-        for (auto& node : *root){
-            if (!(node.isLeafParent())) continue;
-            leafparents.push_back(&node);
-            }
-        for (auto node : leafparents){
-            didUpdate = merge_leafparent_Mar03(node);
-            }
+    /*
+    Heap memory of all per-event buffers: what the current event uses, or all capacity held
+    (including what the arena will keep after the event). The stats collected for the end of
+    the job are not per-event, and not counted.
+    */
+    size_t memoryBytes(bool inUse) const {
+        size_t bytes = vectorBytes(inUse, traceNodes_, traceMerges_)
+            + (inUse ? trackHasHits_.size() : trackHasHits_.capacity()) / 8
+            + trackIdMap_.memoryBytes(inUse) + tree_.memoryBytes(inUse) + subtree_.memoryBytes(inUse)
+            + engine_.memoryBytes(inUse) + hitAggregator_.memoryBytes(inUse) + history_.memoryBytes(inUse)
+            + mergeTree_.memoryBytes(inUse) + arena_.memoryBytes(inUse);
+        for (const ClusteringEngine& engine : subtreeEngines_) bytes += engine.memoryBytes(inUse);
+        for (const EventArena& arena : subtreeArenas_) bytes += arena.memoryBytes(inUse);
+        for (const MergeHistory& history : subtreeHistories_) bytes += history.memoryBytes(inUse);
+        return bytes;
         }
-    edm::LogVerbatim("SimMerging") << "Done after iteration " << iIteration;
-    }
 
-// _______________________________________________
+    /*
+    Frees all per-event buffers, so a huge event does not keep its memory for the rest of the
+    job; must be called at the end of an event. The arena is freed when it is reset.
+    */
+    void release(){
+        trackIdMap_ = TrackIdMap();
+        trackHasHits_ = vector<bool>();
+        tree_ = SimTree();
+        subtree_ = SimTree();
+        engine_ = ClusteringEngine(bruteForceMerging_);
+        hitAggregator_ = HitAggregator();
+        subtreeEngines_.clear();
+        subtreeArenas_.clear();
+        subtreeHistories_.clear();
+        history_ = MergeHistory();
+        mergeTree_ = MergeTreeSnapshot();
+        arena_.release();
+        traceNodes_ = vector<MergeTraceNode>();
+        traceMerges_ = vector<MergeTraceMerge>();
+        }
 
+    bool bruteForceMerging_;
+    TrackIdMap trackIdMap_;
+    vector<bool> trackHasHits_; // Bitmap over the SimTrack indices
+    SimTree tree_; // Arena for the SimTrack tree; reset every event
+    SimTree subtree_; // The primary subtree being merged, for streamSubtrees
+    ClusteringEngine engine_;
+    HitAggregator hitAggregator_;
+    tbb::enumerable_thread_specific<ClusteringEngine> subtreeEngines_; // Per-thread scratch for parallelSubtrees
+    tbb::enumerable_thread_specific<EventArena> subtreeArenas_;
+    tbb::enumerable_thread_specific<MergeHistory> subtreeHistories_;
+    MergeHistory history_;
+    MergeTreeSnapshot mergeTree_; // The tree before merging, if recordMergeTree
+    EventArena arena_; // Per-event scratch containers; released at the end of every event
+    vector<SimMergerStats> stats_; // One entry per event, if instrumented
+    vector<MergeTraceNode> traceNodes_; // Trace of the current event, if tracing
+    vector<MergeTraceMerge> traceMerges_;
+    };
 
-class simmerger : public edm::stream::EDProducer<> {
+/*
+The module itself only holds the configuration, so a single instance serves all streams;
+the per-event state lives in the SimMergerStreamCache of the stream.
+*/
+class simmerger : public edm::global::EDProducer<edm::StreamCache<SimMergerStreamCache>> {
     public:
         explicit simmerger(const edm::ParameterSet&);
         ~simmerger() {}
-        SimCluster mergedSimClusterFromTrackIds(std::vector<int>& trackIds, 
-            const edm::Association<SimClusterCollection>& simTrackToSimCluster);
+        static void fillDescriptions(edm::ConfigurationDescriptions& descriptions);
     private:
-        virtual void produce(edm::Event&, const edm::EventSetup&) override;
-        void beginRun(const edm::Run&, const edm::EventSetup&) override {}
-        hgcal::RecHitTools hgcalRecHitToolInstance_ ;
+        std::unique_ptr<SimMergerStreamCache> beginStream(edm::StreamID) const override;
+        void produce(edm::StreamID, edm::Event&, const edm::EventSetup&) const override;
+        void endStream(edm::StreamID) const override;
+        void endJob() override;
+        typedef std::array<edm::Handle<edm::View<PCaloHit>>, 3> HitHandles;
+        bool selectHit(
+            const PCaloHit& hit, const HGCalCellTable& cells, const TrackIdMap& trackIdMap,
+            uint32_t& cell, uint32_t& track, size_t& nDropped
+            ) const;
+        void storeHit(
+            SimTree& tree, HitAggregator& hitAggregator, const HGCalCellTable& cells, const PCaloHit& hit,
+            uint32_t cell, uint32_t track
+            ) const;
+        bool mergeSubtreesStreaming(
+            SimMergerStreamCache& cache, const HGCalCellTable& cells, const HitHandles& handles,
+            const edm::SimTrackContainer& tracks, const edm::SimVertexContainer& vertices,
+            MergeHistory* history, StageClock& clock, size_t& peakMemory
+            ) const;
         edm::EDGetTokenT<edm::View<PCaloHit>> hgcalEEHitsToken_;
         edm::EDGetTokenT<edm::View<PCaloHit>> hgcalHEfrontHitsToken_;
         edm::EDGetTokenT<edm::View<PCaloHit>> hgcalHEbackHitsToken_;
@@ -533,7 +628,34 @@ class simmerger : public edm::stream::EDProducer<> {
         edm::EDGetTokenT<edm::SimVertexContainer> tokenSimVertices;
         edm::EDGetTokenT<SimClusterCollection> simClustersToken_;
         edm::EDGetTokenT<edm::Association<SimClusterCollection>> simTrackToSimClusterToken_;
-        unordered_map<unsigned int, SimTrackRef> trackIdToTrackRef_;
+        edm::ESGetToken<HGCalCellTable, CaloGeometryRecord> cellTableToken_;
+        bool bruteForceMerging_;
+        bool parallelSubtrees_;
+        bool aggregateHits_;
+        bool fullOutput_;
+        bool compactOutput_;
+        double maxMergeRadius_;
+        bool recordMergeHistory_;
+        bool recordMergeTree_;
+        bool streamSubtrees_;
+        double maxEventMemory_; // Bytes; 0 means no ceiling
+        bool skipOversizedEvents_;
+        double minHitEnergy_;
+        double maxHitTime_;
+        bool useHGCalEE_;
+        bool useHGCalHSi_;
+        bool useHGCalHSc_;
+        bool instrument_;
+        bool storeStats_;
+        int logLevel_;
+        vector<unsigned> dumpEvents_; // Sorted
+        std::unique_ptr<MergeTraceWriter> traceWriter_; // Null if not tracing
+        // The per-event stats of all streams, collected at endStream for the summary at endJob
+        mutable std::mutex statsMutex_;
+        CMS_THREAD_GUARD(statsMutex_) mutable vector<SimMergerStats> jobStats_;
+        bool useDetector(DetId::Detector det) const {
+            return (det == DetId::HGCalEE) ? useHGCalEE_ : ((det == DetId::HGCalHSi) ? useHGCalHSi_ : useHGCalHSc_);
+            }
     };
 
 
@@ -544,159 +666,619 @@ simmerger::simmerger(const edm::ParameterSet& iConfig) :
     tokenSimTracks(consumes<edm::SimTrackContainer>(edm::InputTag("g4SimHits"))),
     tokenSimVertices(consumes<edm::SimVertexContainer>(edm::InputTag("g4SimHits"))),
     simClustersToken_(consumes<SimClusterCollection>(edm::InputTag("mix:MergedCaloTruth"))),
-    simTrackToSimClusterToken_(consumes<edm::Association<SimClusterCollection>>(edm::InputTag("mix:simTrackToSimCluster")))
+    simTrackToSimClusterToken_(consumes<edm::Association<SimClusterCollection>>(edm::InputTag("mix:simTrackToSimCluster"))),
+    cellTableToken_(esConsumes()),
+    bruteForceMerging_(iConfig.getParameter<bool>("bruteForceMerging")),
+    parallelSubtrees_(iConfig.getParameter<bool>("parallelSubtrees")),
+    aggregateHits_(iConfig.getParameter<bool>("aggregateHits")),
+    fullOutput_(iConfig.getParameter<bool>("fullOutput")),
+    compactOutput_(iConfig.getParameter<bool>("compactOutput")),
+    maxMergeRadius_(iConfig.getParameter<double>("maxMergeRadius")),
+    recordMergeHistory_(iConfig.getParameter<bool>("recordMergeHistory")),
+    recordMergeTree_(iConfig.getParameter<bool>("recordMergeTree")),
+    streamSubtrees_(iConfig.getParameter<bool>("streamSubtrees")),
+    maxEventMemory_(iConfig.getParameter<double>("maxEventMemoryMB") * 1024 * 1024),
+    skipOversizedEvents_(iConfig.getParameter<bool>("skipOversizedEvents")),
+    minHitEnergy_(iConfig.getParameter<double>("minHitEnergy")),
+    maxHitTime_(iConfig.getParameter<double>("maxHitTime")),
+    useHGCalEE_(iConfig.getParameter<bool>("useHGCalEE")),
+    useHGCalHSi_(iConfig.getParameter<bool>("useHGCalHSi")),
+    useHGCalHSc_(iConfig.getParameter<bool>("useHGCalHSc")),
+    instrument_(iConfig.getParameter<bool>("instrument") || iConfig.getParameter<bool>("storeStats")),
+    storeStats_(iConfig.getParameter<bool>("storeStats")),
+    logLevel_(iConfig.getUntrackedParameter<int>("logLevel")),
+    dumpEvents_(iConfig.getUntrackedParameter<vector<unsigned>>("dumpEvents"))
     {
-    produces<SimClusterCollection>();
-    produces<edm::Association<SimClusterCollection>>();
+    std::sort(dumpEvents_.begin(), dumpEvents_.end());
+    std::string traceFile = iConfig.getUntrackedParameter<std::string>("traceFile");
+    if (!traceFile.empty()) traceWriter_ = std::make_unique<MergeTraceWriter>(traceFile);
+    if (fullOutput_){
+        produces<SimClusterCollection>();
+        produces<edm::Association<SimClusterCollection>>();
+        }
+    if (compactOutput_){
+        produces<vector<unsigned>>("offsets");
+        produces<vector<unsigned>>("keys");
+        produces<vector<int>>("pdgIds");
+        }
+    if (recordMergeHistory_){
+        produces<vector<unsigned>>("mergeSurvivors");
+        produces<vector<unsigned>>("mergeAbsorbed");
+        produces<vector<float>>("mergeDistances");
+        }
+    if (recordMergeTree_){
+        produces<vector<int>>("mergeTreeNodes");
+        produces<vector<double>>("mergeTreeSums");
+        produces<vector<float>>("mergeTreeFirstHits");
+        }
+    if (storeStats_){
+        produces<vector<double>>("stageTimes");
+        produces<vector<double>>("counters");
+        }
     }
 
-SimCluster simmerger::mergedSimClusterFromTrackIds(std::vector<int>& trackIds, 
-    const edm::Association<SimClusterCollection>& simTrackToSimCluster) {
-    SimCluster sc; 
-    for (auto tid : trackIds) {
-        if (trackIdToTrackRef_.find(tid) == trackIdToTrackRef_.end())
-            throw cms::Exception("SimClusterTreeMerger") << "Failed to find a trackId in the TrackMap.";
-        sc += *simTrackToSimCluster[trackIdToTrackRef_[tid]];
+void simmerger::fillDescriptions(edm::ConfigurationDescriptions& descriptions) {
+    edm::ParameterSetDescription desc;
+    // Use the original O(n^3) pairwise rescan instead of the cached nearest-neighbour engine
+    desc.add<bool>("bruteForceMerging", false);
+    // Collapse the subtrees below the primaries in parallel TBB tasks; the output does not change
+    desc.add<bool>("parallelSubtrees", false);
+    // Combine the PCaloHits of one track in one cell into a single hit before building the tree
+    desc.add<bool>("aggregateHits", false);
+    // Hit prefilter: minimum PCaloHit energy (GeV), maximum time (ns; negative means no cut),
+    // and which subdetectors to take hits from
+    desc.add<double>("minHitEnergy", 0.);
+    desc.add<double>("maxHitTime", -1.);
+    desc.add<bool>("useHGCalEE", true);
+    desc.add<bool>("useHGCalHSi", true);
+    desc.add<bool>("useHGCalHSc", true);
+    // Write the merged SimClusters (and the association from the input SimClusters) in full,
+    // and/or only the membership of every merged cluster as keys into mix:MergedCaloTruth
+    // (instances offsets, keys and pdgIds; read them with MergedSimClusters.h)
+    desc.add<bool>("fullOutput", true);
+    desc.add<bool>("compactOutput", false);
+    // Merge nodes whose hit centroids are closer than this (cm)
+    desc.add<double>("maxMergeRadius", 10.);
+    // Store every merge (surviving and absorbed input SimCluster key, distance) in merge order
+    // (instances mergeSurvivors, mergeAbsorbed and mergeDistances), e.g. to study the merge
+    // distances; this records the merging at maxMergeRadius only
+    desc.add<bool>("recordMergeHistory", false);
+    // Store the tree that goes into the merging, with the hit summaries of its nodes (instances
+    // mergeTreeNodes, mergeTreeSums and mergeTreeFirstHits, 68 bytes per node), from which
+    // replayMerging in MergeReplay.h gives the exact clustering for any other radius
+    desc.add<bool>("recordMergeTree", false);
+    // Build, load and collapse one primary subtree at a time, so only the nodes and hits of the
+    // largest subtree are in memory at once; the output does not change. This is also done
+    // for any event whose hits would need more than maxEventMemoryMB (0: no ceiling), and the
+    // buffers of a stream are freed after an event that made them grow beyond the ceiling.
+    // If even one subtree needs more than that, the default is to merge it anyway, with a
+    // LogWarning; with skipOversizedEvents the event gets empty products instead
+    desc.add<bool>("streamSubtrees", false);
+    desc.add<double>("maxEventMemoryMB", 0.);
+    desc.add<bool>("skipOversizedEvents", false);
+    // Time the stages (ingest, build, merge, output) of every event and count the work done,
+    // and log percentiles and a histogram of them at the end of the job. With storeStats the
+    // numbers of every event are also stored, as instances stageTimes (ms) and counters, in
+    // the order of SimMergerStats::Stage and SimMergerStats::Counter
+    desc.add<bool>("instrument", false);
+    desc.add<bool>("storeStats", false);
+    // Run-time log level: 0 nothing (default), 1 a summary per event, 2 every merge, 3 also
+    // the tree building; levels above SIMMERGER_MAX_LOG_LEVEL are compiled out. The events
+    // with the numbers in dumpEvents are logged at level 3, including dumps of the whole tree
+    desc.addUntracked<int>("logLevel", kLogNone);
+    desc.addUntracked<vector<unsigned>>("dumpEvents", {});
+    // Write the tree and every merge of every event to this binary file (see MergeTrace.h and
+    // python/mergetrace.py); empty: no trace
+    desc.addUntracked<std::string>("traceFile", "");
+    descriptions.add("simmerger", desc);
     }
-    return sc;
-}
 
-void simmerger::produce(edm::Event& iEvent, const edm::EventSetup& iSetup) {  
-    edm::ESHandle<CaloGeometry> geom;
-    iSetup.get<CaloGeometryRecord>().get(geom);
-    hgcalRecHitToolInstance_.setGeometry(*geom);
-    trackIdToTrackRef_.clear();
+std::unique_ptr<SimMergerStreamCache> simmerger::beginStream(edm::StreamID) const {
+    return std::make_unique<SimMergerStreamCache>(bruteForceMerging_);
+    }
 
-    auto output = std::make_unique<SimClusterCollection>();
+void simmerger::endStream(edm::StreamID streamID) const {
+    SimMergerStreamCache& cache = *streamCache(streamID);
+    std::lock_guard<std::mutex> guard(statsMutex_);
+    jobStats_.insert(jobStats_.end(), cache.stats_.begin(), cache.stats_.end());
+    cache.stats_.clear();
+    }
 
-    // Create Hit instances
-    vector<Hit> hits;
-    vector<edm::EDGetTokenT<edm::View<PCaloHit>>> tokens = {
+void simmerger::endJob() {
+    std::lock_guard<std::mutex> guard(statsMutex_);
+    logStatsSummary(jobStats_);
+    if (traceWriter_) traceWriter_->flush();
+    }
+
+void simmerger::produce(edm::StreamID streamID, edm::Event& iEvent, const edm::EventSetup& iSetup) const {
+    SimMergerStreamCache& cache = *streamCache(streamID);
+    SimMergerStats eventStats;
+    SimMergerStats* stats = instrument_ ? &eventStats : nullptr;
+    StageClock clock(stats);
+    // Declared first, so the arena is released after all containers using it, even on exceptions
+    EventArena::Scope arenaScope(cache.arena_);
+    SimTree& tree = cache.tree_;
+    // The events in dumpEvents are logged in full detail, including dumps of the tree
+    tree.logLevel_ = std::binary_search(dumpEvents_.begin(), dumpEvents_.end(), iEvent.id().event()) ? kLogTree : logLevel_;
+    const HGCalCellTable& cells = iSetup.getData(cellTableToken_);
+
+    edm::Handle<edm::SimTrackContainer> handleSimTracks;
+    iEvent.getByToken(tokenSimTracks, handleSimTracks);
+    edm::Handle<edm::SimVertexContainer> handleSimVertices;
+    iEvent.getByToken(tokenSimVertices, handleSimVertices);
+    const edm::SimTrackContainer& tracks = *handleSimTracks;
+    cache.trackIdMap_.build(tracks);
+
+    const edm::EDGetTokenT<edm::View<PCaloHit>> tokens[] = {
         hgcalEEHitsToken_,
         hgcalHEfrontHitsToken_,
         hgcalHEbackHitsToken_
         };
-    std::set<int> trackids_with_hits;
-    for (edm::EDGetTokenT<edm::View<PCaloHit>> token : tokens ) {
-        edm::Handle< edm::View<PCaloHit> > handle;
-        iEvent.getByToken(token, handle);
-        for (auto const & hit : handle->ptrs() ) {
-            DetId id = hit->id();
-            GlobalPoint position = hgcalRecHitToolInstance_.getPosition(id);
-            hits.push_back(Hit(
-                position.x(), position.y(), position.z(),
-                hit->time(), hit->energy(), hit->geantTrackId()
-                ));
-            trackids_with_hits.insert(hit->geantTrackId());
-            }
-        }
-
-    // Build the tree
-    edm::Handle<edm::SimTrackContainer> handleSimTracks;
-    iEvent.getByLabel("g4SimHits", handleSimTracks);
-    edm::Handle<edm::SimVertexContainer> handleSimVertices;
-    iEvent.getByLabel("g4SimHits", handleSimVertices);
-
-    edm::LogVerbatim("SimMerging") << "Building map";
-    unordered_map<int, Node> trackid_to_node;
-    for(size_t i = 0; i < handleSimTracks->size(); i++){
-        SimTrackRef track(handleSimTracks, i);
-        trackid_to_node.emplace(track->trackId(), Node(track->trackId(), track->momentum().E(), track->type()));
-        trackIdToTrackRef_[track->trackId()] = track;
-        }
-
-    edm::LogVerbatim("SimMerging") << "Adding hits to nodes";
-    for (auto& hit : hits){
-        trackid_to_node[hit.trackid_].addHit(&hit);
-        }
-
-    edm::LogVerbatim("SimMerging") << "Building tree";
-    Node* root(new Node());
-    for(const auto& track : *handleSimTracks){
-        int trackid = track.trackId();
-        Node* node = &(trackid_to_node[trackid]);
-        // Have to get parent info via the SimVertex
-        SimVertex vertex = handleSimVertices.product()->at(track.vertIndex());
-        bool hasParent = !(vertex.noParent());
-        // Build the tree
-        if (hasParent){
-            int parentid = vertex.parentIndex();
-            edm::LogVerbatim("SimMerging")
-                << "Setting parent->child relationship: "
-                << parentid << " -> " << trackid
-                ;
-            auto it = trackid_to_node.find(parentid);
-            if (it != trackid_to_node.end()){
-                Node* parent = &(it->second);
-                node->setParent(parent);
-                parent->addChild(node);
-                }
-            else{
-                throw cms::Exception("Unknown")
-                    << "Track id " << parentid
-                    << " is not in the map"
-                    ;
+    HitHandles handles;
+    size_t nPCaloHits = 0;
+    for (size_t i = 0; i < std::size(tokens); ++i){
+        iEvent.getByToken(tokens[i], handles[i]);
+        nPCaloHits += handles[i]->size();
+        }
+
+    bool streaming = streamSubtrees_ || (maxEventMemory_ > 0. && nPCaloHits * SimTree::kBytesPerHit > maxEventMemory_);
+
+    // Start from an empty tree; this keeps the memory allocated in earlier events
+    tree.clear(0, streaming ? 0 : nPCaloHits);
+    NodeIndex root = tree.root();
+    cache.trackHasHits_.assign(tracks.size(), false);
+    cache.mergeTree_.clear();
+    cache.history_.clear();
+    // The trace takes its merges from the history
+    MergeHistory* history = (recordMergeHistory_ || traceWriter_) ? &cache.history_ : nullptr;
+    cache.traceNodes_.clear();
+    cache.traceMerges_.clear();
+    cache.engine_.resetCounters();
+    for (ClusteringEngine& engine : cache.subtreeEngines_) engine.resetCounters();
+
+    size_t peakMemory = 0;
+    if (streaming){
+        SIMMERGER_LOG(kLogEvent, tree.logLevel_) << "Merging the primary subtrees one at a time";
+        // A skipped event is left with an empty tree, so all its products are empty
+        bool skipped = !mergeSubtreesStreaming(cache, cells, handles, tracks, *handleSimVertices, history, clock, peakMemory);
+        if (stats) stats->count_[SimMergerStats::kSkipped] = skipped;
+        }
+    else {
+        // Store the hits, and flag the SimTracks that have hits
+        if (aggregateHits_) cache.hitAggregator_.clear(nPCaloHits);
+        size_t nDropped = 0, nSelected = 0;
+        for (const auto& handle : handles) {
+            for (const PCaloHit& hit : *handle) {
+                uint32_t cell, track;
+                if (!selectHit(hit, cells, cache.trackIdMap_, cell, track, nDropped)) continue;
+                nSelected++;
+                cache.trackHasHits_[track] = true;
+                storeHit(tree, cache.hitAggregator_, cells, hit, cell, track);
                 }
             }
-        else{
-            edm::LogVerbatim("SimMerging") << "Found parentless particle: " << node->trackid_;
-            root->addChild(node);
-            node->setParent(root);
+        SIMMERGER_LOG(kLogEvent, tree.logLevel_)
+            << "Prefilter dropped " << nDropped << " of " << nPCaloHits << " PCaloHits";
+        if (stats){
+            stats->count_[SimMergerStats::kDropped] = nDropped;
+            stats->count_[SimMergerStats::kSelected] = nSelected;
             }
-        }
-
-#ifdef EDM_ML_DEBUG
-    edm::LogVerbatim("SimMerging") << "Printing root " << root->trackid_;
-    edm::LogVerbatim("SimMerging") << root->stringrep() << "\n";
-    edm::LogVerbatim("SimMerging") << "Trimming tree...";
-#endif
+        if (aggregateHits_){
+            cache.hitAggregator_.finish(tree);
+            SIMMERGER_LOG(kLogEvent, tree.logLevel_)
+                << "Aggregated " << cache.hitAggregator_.nInput() << " PCaloHits into "
+                << cache.hitAggregator_.nOutput() << " hits (reduction factor "
+                << (cache.hitAggregator_.nOutput() ? (double)cache.hitAggregator_.nInput() / cache.hitAggregator_.nOutput() : 1.)
+                << ")";
+            }
+        if (stats) stats->count_[SimMergerStats::kHits] = tree.nHitsTotal();
+        peakMemory = cache.memoryBytes(true);
+        clock.lap(SimMergerStats::kIngest);
 
-    trim_tree(root);
+        // Build the (trimmed) tree
+        SIMMERGER_LOG(kLogEvent, tree.logLevel_) << "Building tree";
+        build_trimmed_tree(tree, tracks, *handleSimVertices, cache.trackIdMap_, cache.trackHasHits_, &cache.arena_);
+        if (stats) stats->count_[SimMergerStats::kNodes] = tree.size()-1;
+        if (traceWriter_){
+            for (NodeIndex node = 0; node < tree.size(); ++node){
+                if (node != root) cache.traceNodes_.push_back(traceNode(tree, node));
+                }
+            }
+        if (recordMergeTree_){
+            for (NodeIndex top = tree.firstChild_[root]; top != kNoNode; top = tree.nextSibling_[top]) cache.mergeTree_.add(tree, top);
+            }
+        clock.lap(SimMergerStats::kBuild);
 
-#ifdef EDM_ML_DEBUG
-    edm::LogVerbatim("SimMerging") << "Printing root " << root->trackid_ << " after trimming";
-    edm::LogVerbatim("SimMerging") << root->stringrep() << "\n";
-    edm::LogVerbatim("SimMerging") << "Running merging algo...";
-#endif
+        SIMMERGER_LOG(kLogTree, tree.logLevel_)
+            << "Tree of event " << iEvent.id().event() << " after building and trimming:\n" << tree.stringrep(root);
+        SIMMERGER_LOG(kLogMerges, tree.logLevel_) << "Running merging algo...";
 
-    merging_algo_Mar03(root);
+        if (parallelSubtrees_){
+            merging_algo_Mar03_parallel(
+                tree, cache.engine_, cache.arena_, maxMergeRadius_, history,
+                cache.subtreeEngines_, cache.subtreeArenas_, cache.subtreeHistories_
+                );
+            }
+        else merging_algo_Mar03(tree, cache.engine_, &cache.arena_, maxMergeRadius_, history);
+        peakMemory = std::max(peakMemory, cache.memoryBytes(true));
+        clock.lap(SimMergerStats::kMerge);
+        }
 
-#ifdef EDM_ML_DEBUG
-    edm::LogVerbatim("SimMerging") << "Printing root " << root->trackid_ << " after merging_algo_Mar03";
-    edm::LogVerbatim("SimMerging") << root->stringrep() << "\n";
-#endif
+    SIMMERGER_LOG(kLogTree, tree.logLevel_)
+        << "Tree of event " << iEvent.id().event() << " after merging:\n" << tree.stringrep(root);
+    SIMMERGER_LOG(kLogEvent, tree.logLevel_)
+        << "Peak memory of the merging: " << peakMemory << " bytes; "
+        << cache.memoryBytes(false) << " bytes held by the stream";
     edm::Handle<edm::Association<SimClusterCollection>> simTrackToSimClusterHandle;
     iEvent.getByToken(simTrackToSimClusterToken_, simTrackToSimClusterHandle);
 
     edm::Handle<SimClusterCollection> simClusterHandle;
     iEvent.getByToken(simClustersToken_, simClusterHandle);
 
-    // Fill the output; the clusters are the remaining nodes (except the root)
-    size_t i = 0;
-    std::vector<int> mergedIndices(simClusterHandle->size(), 0);
-    for(auto cluster : root->children_) {
-        SimCluster sc; 
-        for (auto tid : cluster->mergedTrackIds_) {
-            if (trackIdToTrackRef_.find(tid) == trackIdToTrackRef_.end())
-                throw cms::Exception("SimClusterTreeMerger") << "Failed to find a trackId in the TrackMap.";
-            const auto& unmerged = (*simTrackToSimClusterHandle)[trackIdToTrackRef_[tid]];
-            mergedIndices.at(unmerged.key()) = i;
-            sc += *unmerged;
+    // The clusters are the remaining nodes (except the root). First collect the keys of the
+    // source SimClusters of every cluster; the source SimCluster of a SimTrack is looked up by
+    // the index of the SimTrack in its product, without a Ref per track
+    const edm::Association<SimClusterCollection>& trackToCluster = *simTrackToSimClusterHandle;
+    edm::ProductID tracksId = handleSimTracks.id();
+    auto offsets = std::make_unique<vector<unsigned>>();
+    auto keys = std::make_unique<vector<unsigned>>();
+    auto pdgIds = std::make_unique<vector<int>>();
+    offsets->push_back(0);
+    for (NodeIndex cluster = tree.firstChild_[root]; cluster != kNoNode; cluster = tree.nextSibling_[cluster]) {
+        for (uint32_t member = tree.firstMember_[cluster]; member != SimTree::kNoMember; member = tree.memberNext_[member]) {
+            keys->push_back(trackToCluster.get(tracksId, tree.memberTrack_[member]).key());
+            }
+        offsets->push_back(keys->size());
+        pdgIds->push_back(tree.pdgid_[cluster]);
+        }
+    size_t nClusters = pdgIds->size();
+
+    if (compactOutput_ && simMergerLogOn(kLogEvent, tree.logLevel_)){
+        // Compare with what the full output would have stored; only an estimate of the in-memory
+        // size, not of the size on disk after compression
+        size_t fullSize = nClusters * sizeof(SimCluster);
+        for (unsigned key : *keys){
+            const SimCluster& source = (*simClusterHandle)[key];
+            fullSize += source.numberOfRecHits() * (sizeof(uint32_t) + 2*sizeof(float))
+                + source.g4Tracks().size() * sizeof(SimTrack);
+            }
+        size_t compactSize = (offsets->size() + keys->size()) * sizeof(unsigned) + pdgIds->size() * sizeof(int);
+        edm::LogVerbatim("SimMerging")
+            << "Compact output: " << compactSize << " bytes for " << nClusters
+            << " clusters, vs. about " << fullSize << " bytes as SimClusters";
+        }
+
+    if (fullOutput_){
+        // Every cluster is built in place in the output collection
+        auto output = std::make_unique<SimClusterCollection>();
+        output->reserve(nClusters);
+        // Without any cluster (e.g. a skipped event) there is nothing to refer to: null refs
+        std::pmr::vector<int> mergedIndices(simClusterHandle->size(), nClusters ? 0 : -1, &cache.arena_);
+        for (size_t i = 0; i < nClusters; ++i){
+            SimCluster& sc = output->emplace_back();
+            for (unsigned k = (*offsets)[i]; k < (*offsets)[i+1]; ++k){
+                unsigned key = (*keys)[k];
+                mergedIndices.at(key) = i;
+                sc += (*simClusterHandle)[key];
+                }
+            sc.setPdgId((*pdgIds)[i]);
+            }
+
+        const auto& mergedSCHandle = iEvent.put(std::move(output));
+
+        auto assoc = std::make_unique<edm::Association<SimClusterCollection>>(mergedSCHandle);
+        edm::Association<SimClusterCollection>::Filler filler(*assoc);
+        filler.insert(simClusterHandle, mergedIndices.begin(), mergedIndices.end());
+        filler.fill();
+        iEvent.put(std::move(assoc));
+        }
+    if (compactOutput_){
+        iEvent.put(std::move(offsets), "offsets");
+        iEvent.put(std::move(keys), "keys");
+        iEvent.put(std::move(pdgIds), "pdgIds");
+        }
+    if (recordMergeHistory_){
+        // In terms of the input SimClusters, like the compact output
+        auto survivors = std::make_unique<vector<unsigned>>();
+        auto absorbed = std::make_unique<vector<unsigned>>();
+        survivors->reserve(cache.history_.size());
+        absorbed->reserve(cache.history_.size());
+        for (size_t k = 0; k < cache.history_.size(); ++k){
+            survivors->push_back(trackToCluster.get(tracksId, cache.history_.survivor_[k]).key());
+            absorbed->push_back(trackToCluster.get(tracksId, cache.history_.absorbed_[k]).key());
+            }
+        SIMMERGER_LOG(kLogEvent, tree.logLevel_) << "Recorded " << cache.history_.size() << " merges";
+        iEvent.put(std::move(survivors), "mergeSurvivors");
+        iEvent.put(std::move(absorbed), "mergeAbsorbed");
+        iEvent.put(std::make_unique<vector<float>>(cache.history_.distance_), "mergeDistances");
+        }
+    if (recordMergeTree_){
+        auto treeNodes = std::make_unique<vector<int>>(cache.mergeTree_.nodes_);
+        for (size_t k = 1; k < treeNodes->size(); k += MergeTreeSnapshot::kInts){
+            (*treeNodes)[k] = trackToCluster.get(tracksId, (*treeNodes)[k]).key();
+            }
+        iEvent.put(std::move(treeNodes), "mergeTreeNodes");
+        iEvent.put(std::make_unique<vector<double>>(cache.mergeTree_.sums_), "mergeTreeSums");
+        iEvent.put(std::make_unique<vector<float>>(cache.mergeTree_.firstHits_), "mergeTreeFirstHits");
+        }
+    if (traceWriter_){
+        // The history is in SimTrack indices; the trace is in node indices
+        std::pmr::vector<NodeIndex> nodeOfTrack(tracks.size(), kNoNode, &cache.arena_);
+        for (const MergeTraceNode& node : cache.traceNodes_) nodeOfTrack[node.track_] = node.node_;
+        for (size_t k = 0; k < cache.history_.size(); ++k){
+            cache.traceMerges_.push_back(MergeTraceMerge{
+                nodeOfTrack[cache.history_.survivor_[k]], nodeOfTrack[cache.history_.absorbed_[k]], cache.history_.distance_[k]
+                });
+            }
+        MergeTraceEvent event{iEvent.id().event(), iEvent.id().run(), (uint32_t)nPCaloHits, 0, 0};
+        traceWriter_->write(event, cache.traceNodes_, cache.traceMerges_);
+        }
+    if (stats){
+        clock.lap(SimMergerStats::kOutput);
+        stats->count_[SimMergerStats::kPCaloHits] = nPCaloHits;
+        stats->count_[SimMergerStats::kSimTracks] = tracks.size();
+        stats->addEngine(cache.engine_);
+        for (const ClusteringEngine& engine : cache.subtreeEngines_) stats->addEngine(engine);
+        cache.stats_.push_back(eventStats);
+        if (simMergerLogOn(kLogEvent, tree.logLevel_)){
+            edm::LogVerbatim log("SimMerging");
+            log << "Stage times [ms]:";
+            for (int stage = 0; stage < SimMergerStats::kNStages; ++stage)
+                log << " " << SimMergerStats::kStageNames[stage] << " " << stats->time_[stage];
+            log << "; counters:";
+            for (int counter = 0; counter < SimMergerStats::kNCounters; ++counter)
+                log << " " << SimMergerStats::kCounterNames[counter] << " " << stats->count_[counter];
+            }
+        if (storeStats_){
+            iEvent.put(std::make_unique<vector<double>>(std::begin(stats->time_), std::end(stats->time_)), "stageTimes");
+            iEvent.put(std::make_unique<vector<double>>(std::begin(stats->count_), std::end(stats->count_)), "counters");
+            }
+        }
+    SIMMERGER_LOG(kLogEvent, tree.logLevel_)
+        << "Event arena: " << cache.arena_.used() << " bytes used, high-water mark "
+        << cache.arena_.highWater() << " bytes, buffer " << cache.arena_.capacity() << " bytes";
+    // Do not keep the memory of an exceptionally large event for the rest of the job
+    if (maxEventMemory_ > 0. && cache.memoryBytes(false) > maxEventMemory_){
+        SIMMERGER_LOG(kLogEvent, tree.logLevel_) << "Above the memory ceiling; freeing the buffers of the stream";
+        cache.release();
+        }
+    }
+
+/*
+Looks up the cell and SimTrack index of a hit. Returns false if the prefilter drops the hit
+(counted in nDropped), or if its SimTrack was not saved. The prefilter only needs the hit and
+its DetId, so it runs before the cell lookup: dropped hits cost no search in the cell table,
+and are not required to be in it.
+*/
+bool simmerger::selectHit(
+        const PCaloHit& hit, const HGCalCellTable& cells, const TrackIdMap& trackIdMap,
+        uint32_t& cell, uint32_t& track, size_t& nDropped
+        ) const {
+    // Prefilter: drop soft, late and deselected hits before they reach the tree
+    if (
+        hit.energy() < minHitEnergy_
+        || (maxHitTime_ >= 0. && hit.time() > maxHitTime_)
+        || !useDetector(DetId(hit.id()).det())
+        ){
+        nDropped++;
+        return false;
+        }
+    cell = cells.find(hit.id());
+    if (cell == HGCalCellTable::kNotFound){
+        throw cms::Exception("SimMerging")
+            << "Hit with DetId " << hit.id()
+            << " is not in the HGCAL cell table"
+            ;
+        }
+    // Hits of tracks that were not saved cannot be put in the tree
+    track = trackIdMap.find(hit.geantTrackId());
+    return track != kNoTrack;
+    }
+
+void simmerger::storeHit(
+        SimTree& tree, HitAggregator& hitAggregator, const HGCalCellTable& cells, const PCaloHit& hit,
+        uint32_t cell, uint32_t track
+        ) const {
+    GlobalPoint position = cells.position(cell);
+    if (aggregateHits_){
+        hitAggregator.add(tree, cell, position.x(), position.y(), position.z(), hit.time(), hit.energy(), track);
+        }
+    else tree.addHit(position.x(), position.y(), position.z(), hit.time(), hit.energy(), track);
+    }
+
+/*
+Bounded-memory version of building the tree and merging it, for events with very many hits.
+The primary subtrees (the children of the root) are built, loaded with their hits and
+collapsed one at a time in cache.subtree_, like in merging_algo_Mar03_parallel; only the
+nodes that survive are copied into the tree, with their hit summaries and members, and the
+nodes and hits of the subtree are dropped before the next one. The final merging at the root
+and the output are the same as without streaming.
+Keeps the index, cell and SimTrack of every selected PCaloHit (12 bytes), rather than the
+hit itself, so the cell table and the track id map are only searched once per PCaloHit; the
+PCaloHits are read twice. Returns false if the event is skipped (skipOversizedEvents). The peak
+memory in use is added to peakMemory, and the stage times and counters to the stats of
+clock, if any.
+*/
+bool simmerger::mergeSubtreesStreaming(
+        SimMergerStreamCache& cache, const HGCalCellTable& cells, const HitHandles& handles,
+        const edm::SimTrackContainer& tracks, const edm::SimVertexContainer& vertices,
+        MergeHistory* history, StageClock& clock, size_t& peakMemory
+        ) const {
+    SimMergerStats* stats = clock.stats();
+    SimTree& tree = cache.tree_;
+    SimTree& subtree = cache.subtree_;
+    subtree.logLevel_ = tree.logLevel_;
+    std::pmr::memory_resource* arena = &cache.arena_;
+    size_t nTracks = tracks.size();
+    auto sampleMemory = [&](){ peakMemory = std::max(peakMemory, cache.memoryBytes(true)); };
+
+    // Select the hits, and flag the SimTracks with hits. A selected hit is kept as its index
+    // (counting over the three collections), its cell and its SimTrack
+    size_t nDropped = 0, nPCaloHits = 0;
+    for (const auto& handle : handles) nPCaloHits += handle->size();
+    std::pmr::vector<uint32_t> selectedIndex(arena), selectedCell(arena), selectedTrack(arena);
+    selectedIndex.reserve(nPCaloHits);
+    selectedCell.reserve(nPCaloHits);
+    selectedTrack.reserve(nPCaloHits);
+    uint32_t index = 0;
+    for (const auto& handle : handles) {
+        for (const PCaloHit& hit : *handle) {
+            uint32_t cell, track;
+            if (selectHit(hit, cells, cache.trackIdMap_, cell, track, nDropped)){
+                cache.trackHasHits_[track] = true;
+                selectedIndex.push_back(index);
+                selectedCell.push_back(cell);
+                selectedTrack.push_back(track);
+                }
+            index++;
+            }
+        }
+    SIMMERGER_LOG(kLogEvent, tree.logLevel_)
+        << "Prefilter dropped " << nDropped << " of " << nPCaloHits << " PCaloHits";
+    if (stats){
+        stats->count_[SimMergerStats::kDropped] = nDropped;
+        stats->count_[SimMergerStats::kSelected] = selectedIndex.size();
+        }
+    clock.lap(SimMergerStats::kIngest);
+
+    // The primaries, in the order of the children of the root in build_trimmed_tree, and the
+    // kept SimTracks of every primary subtree, in SimTrack order
+    TrimmedForest forest(tracks, vertices, cache.trackIdMap_, cache.trackHasHits_, arena);
+    const std::pmr::vector<uint32_t>& kept = forest.keptTracks();
+    std::pmr::vector<uint32_t> tops(arena);
+    for (uint32_t i : kept){
+        if (forest.parent(i) == kNoTrack && !forest.isIntermediate(i)) tops.push_back(i);
         }
-        i++;
-		sc.setPdgId(cluster->pdgid_);
-        output->push_back(sc);
+    for (uint32_t i : kept){
+        if (forest.parent(i) == kNoTrack && forest.isIntermediate(i)) tops.push_back(i);
+        }
+    std::pmr::vector<uint32_t> subtreeOfTrack(nTracks, kNoTrack, arena);
+    for (size_t k = 0; k < tops.size(); ++k) subtreeOfTrack[tops[k]] = k;
+    for (uint32_t i : kept){
+        uint32_t ancestor = i;
+        while (subtreeOfTrack[ancestor] == kNoTrack) ancestor = forest.parent(ancestor);
+        for (uint32_t t = i; subtreeOfTrack[t] == kNoTrack; t = forest.parent(t)) subtreeOfTrack[t] = subtreeOfTrack[ancestor];
+        }
+    std::pmr::vector<uint32_t> subtreeTrackBegin(tops.size()+1, 0, arena);
+    for (uint32_t i : kept) subtreeTrackBegin[subtreeOfTrack[i]+1]++;
+    for (size_t k = 0; k < tops.size(); ++k) subtreeTrackBegin[k+1] += subtreeTrackBegin[k];
+    std::pmr::vector<uint32_t> subtreeTracks(kept.size(), arena);
+    {
+        std::pmr::vector<uint32_t> fill(subtreeTrackBegin.begin(), subtreeTrackBegin.end()-1, arena);
+        for (uint32_t i : kept) subtreeTracks[fill[subtreeOfTrack[i]]++] = i;
         }
 
-    const auto& mergedSCHandle = iEvent.put(std::move(output));
+    // The selected hits (positions in selectedIndex), per subtree
+    size_t nSelected = selectedIndex.size();
+    std::pmr::vector<uint32_t> subtreeHitBegin(tops.size()+1, 0, arena);
+    for (size_t s = 0; s < nSelected; ++s) subtreeHitBegin[subtreeOfTrack[selectedTrack[s]]+1]++;
+    for (size_t k = 0; k < tops.size(); ++k) subtreeHitBegin[k+1] += subtreeHitBegin[k];
+    std::pmr::vector<uint32_t> subtreeHits(nSelected, arena);
+    {
+        std::pmr::vector<uint32_t> fill(subtreeHitBegin.begin(), subtreeHitBegin.end()-1, arena);
+        for (size_t s = 0; s < nSelected; ++s) subtreeHits[fill[subtreeOfTrack[selectedTrack[s]]]++] = s;
+        }
+    auto hitAt = [&](uint32_t index) -> const PCaloHit& {
+        size_t i = 0;
+        while (index >= handles[i]->size()) index -= handles[i++]->size();
+        return (*handles[i])[index];
+        };
+    sampleMemory();
 
-    auto assoc = std::make_unique<edm::Association<SimClusterCollection>>(mergedSCHandle);
-    edm::Association<SimClusterCollection>::Filler filler(*assoc);
-    filler.insert(simClusterHandle, mergedIndices.begin(), mergedIndices.end());
-    filler.fill();
-    iEvent.put(std::move(assoc));
+    size_t largest = 0;
+    for (size_t k = 0; k < tops.size(); ++k){
+        if (subtreeHitBegin[k+1] - subtreeHitBegin[k] > subtreeHitBegin[largest+1] - subtreeHitBegin[largest]) largest = k;
+        }
+    size_t maxHits = tops.empty() ? 0 : subtreeHitBegin[largest+1] - subtreeHitBegin[largest];
+    if (maxEventMemory_ > 0. && maxHits * SimTree::kBytesPerHit > maxEventMemory_){
+        if (skipOversizedEvents_){
+            edm::LogWarning("SimMerging")
+                << "Skipping the event: the " << maxHits << " hits below primary " << tracks[tops[largest]].trackId()
+                << " need more than the memory ceiling of " << maxEventMemory_ << " bytes"
+                ;
+            return false;
+            }
+        edm::LogWarning("SimMerging")
+            << "The " << maxHits << " hits below primary " << tracks[tops[largest]].trackId()
+            << " need more than the memory ceiling of " << maxEventMemory_ << " bytes; merging them anyway"
+            ;
+        }
+
+    // The trace uses the node indices that build_trimmed_tree would have given
+    std::pmr::vector<NodeIndex> traceNodeOfTrack(arena);
+    if (traceWriter_){
+        traceNodeOfTrack.assign(nTracks, kNoNode);
+        NodeIndex node = tree.root();
+        for (uint32_t i : kept){
+            if (!forest.isIntermediate(i)) traceNodeOfTrack[i] = ++node;
+            }
+        }
+    clock.lap(SimMergerStats::kBuild);
 
-    delete root;
+    // Build, load and collapse one subtree at a time. The surviving nodes of every subtree
+    // are copied into the tree; those of the subtrees that were only a leaf stay in place
+    NodeIndex root = tree.root();
+    std::pmr::vector<uint32_t> groupOfTrack(nTracks, kNoTrack, arena);
+    std::pmr::vector<NodeIndex> collapsed(arena);
+    std::pmr::vector<uint32_t> collapsedBegin(1, 0, arena);
+    std::pmr::vector<int> collapsedIn(arena);
+    for (size_t k = 0; k < tops.size(); ++k){
+        const uint32_t* begin = subtreeTracks.data() + subtreeTrackBegin[k];
+        const uint32_t* end = subtreeTracks.data() + subtreeTrackBegin[k+1];
+        size_t nHits = subtreeHitBegin[k+1] - subtreeHitBegin[k];
+        // Drops the nodes and hits of the previous subtree
+        subtree.clear(end - begin, nHits);
+        if (aggregateHits_) cache.hitAggregator_.clear(nHits);
+        for (uint32_t h = subtreeHitBegin[k]; h < subtreeHitBegin[k+1]; ++h){
+            uint32_t s = subtreeHits[h];
+            storeHit(subtree, cache.hitAggregator_, cells, hitAt(selectedIndex[s]), selectedCell[s], selectedTrack[s]);
+            }
+        if (aggregateHits_) cache.hitAggregator_.finish(subtree);
+        for (const uint32_t* it = begin; it != end; ++it) groupOfTrack[*it] = it - begin;
+        subtree.sortHits(end - begin, groupOfTrack.data());
+        forest.addNodes(subtree, begin, end, subtree.root(), groupOfTrack.data());
+        NodeIndex top = subtree.firstChild_[subtree.root()];
+        if (stats){
+            stats->count_[SimMergerStats::kHits] += subtree.nHitsTotal();
+            stats->count_[SimMergerStats::kNodes] += subtree.size()-1;
+            }
+        SIMMERGER_LOG(kLogTree, tree.logLevel_)
+            << "Subtree of primary " << tracks[tops[k]].trackId() << " after building and trimming:\n" << subtree.stringrep(top);
+        if (traceWriter_){
+            for (NodeIndex node : subtree.subtree(top)){
+                MergeTraceNode record = traceNode(subtree, node);
+                record.node_ = traceNodeOfTrack[subtree.track_[node]];
+                record.parent_ = (node == top) ? root : traceNodeOfTrack[subtree.track_[subtree.parent_[node]]];
+                cache.traceNodes_.push_back(record);
+                }
+            }
+        if (recordMergeTree_) cache.mergeTree_.add(subtree, top);
+        sampleMemory();
+        clock.lap(SimMergerStats::kIngest);
+        if (!subtree.hasChildren(top)){
+            tree.addChild(root, tree.addNodeFrom(subtree, top));
+            continue;
+            }
+        collapsedIn.push_back(merge_bottom_up_Mar03(subtree, subtree.root(), false, cache.engine_, arena, maxMergeRadius_, history));
+        for (NodeIndex node = subtree.firstChild_[subtree.root()]; node != kNoNode; node = subtree.nextSibling_[node]){
+            collapsed.push_back(tree.addNodeFrom(subtree, node));
+            }
+        collapsedBegin.push_back(collapsed.size());
+        sampleMemory();
+        clock.lap(SimMergerStats::kMerge);
+        }
+    subtree.clear();
+
+    // Put the collapsed subtrees in the order of merging_algo_Mar03, and merge at the root
+    std::pmr::vector<size_t> order(collapsedIn.size(), arena);
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b){ return collapsedIn[a] < collapsedIn[b]; });
+    for (size_t i : order){
+        for (uint32_t c = collapsedBegin[i]; c < collapsedBegin[i+1]; ++c) tree.addChild(root, collapsed[c]);
+        }
+    merging_algo_Mar03(tree, cache.engine_, arena, maxMergeRadius_, history);
+    sampleMemory();
+    clock.lap(SimMergerStats::kMerge);
+    return true;
     }
 
 DEFINE_FWK_MODULE(simmerger);
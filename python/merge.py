@@ -1,6 +1,38 @@
 import FWCore.ParameterSet.Config as cms
 from FWCore.ParameterSet.VarParsing import VarParsing
 options = VarParsing("analysis")
+options.register(
+    'compact', False, VarParsing.multiplicity.singleton, VarParsing.varType.bool,
+    'Store only the membership of the merged SimClusters (keys into mix:MergedCaloTruth)'
+    )
+options.register(
+    'nThreads', 1, VarParsing.multiplicity.singleton, VarParsing.varType.int,
+    'Number of threads'
+    )
+options.register(
+    'nStreams', 0, VarParsing.multiplicity.singleton, VarParsing.varType.int,
+    'Number of concurrent events (0: one per thread)'
+    )
+options.register(
+    'throughput', False, VarParsing.multiplicity.singleton, VarParsing.varType.bool,
+    'Measure the event throughput with the ThroughputService, without debug output and file writing'
+    )
+options.register(
+    'instrument', False, VarParsing.multiplicity.singleton, VarParsing.varType.bool,
+    'Time the stages of simmerger and count its work; summary at the end, numbers per event in the output'
+    )
+options.register(
+    'logLevel', 0, VarParsing.multiplicity.singleton, VarParsing.varType.int,
+    'Log level of simmerger: 0 nothing, 1 a summary per event, 2 every merge, 3 also the tree building'
+    )
+options.register(
+    'dumpEvents', [], VarParsing.multiplicity.list, VarParsing.varType.int,
+    'Event numbers for which simmerger logs everything, including dumps of the tree'
+    )
+options.register(
+    'traceFile', '', VarParsing.multiplicity.singleton, VarParsing.varType.string,
+    'Write a binary trace of the merging to this file (read it with mergetrace.py)'
+    )
 options.parseArguments()
 
 def add_debug_module(process, module_name='DoFineCalo'):
@@ -24,13 +56,35 @@ process.load('Configuration.StandardSequences.MagneticField_cff')
 process.load('FWCore.MessageService.MessageLogger_cfi')
 
 process.source = cms.Source("PoolSource", fileNames = cms.untracked.vstring(options.inputFiles))
+process.maxEvents = cms.untracked.PSet(input = cms.untracked.int32(options.maxEvents))
+process.options = cms.untracked.PSet(
+    numberOfThreads = cms.untracked.uint32(options.nThreads),
+    numberOfStreams = cms.untracked.uint32(options.nStreams),
+    )
 output_file = options.inputFiles[0].replace('SIM', 'SIMMERGED')
 
-add_debug_module(process, 'SimMerging')
+if options.throughput:
+    # Events/s for 1 to 16 threads: test/throughput.sh inputFile
+    process.ThroughputService = cms.Service('ThroughputService',
+        eventRange = cms.untracked.uint32(100),
+        printEventSummary = cms.untracked.bool(True),
+        )
+    process.MessageLogger.cerr.ThroughputService = cms.untracked.PSet(limit = cms.untracked.int32(10000000))
+else:
+    add_debug_module(process, 'SimMerging')
 
 # process.simulation_step = cms.Path(process.psim)
 
+process.hgcalCellTableESProducer = cms.ESProducer("HGCalCellTableESProducer")
 process.simmerger = cms.EDProducer("simmerger")
+if options.compact:
+    process.simmerger.fullOutput = cms.bool(False)
+    process.simmerger.compactOutput = cms.bool(True)
+if options.instrument:
+    process.simmerger.storeStats = cms.bool(True)
+process.simmerger.logLevel = cms.untracked.int32(0 if options.throughput else options.logLevel)
+process.simmerger.dumpEvents = cms.untracked.vuint32(options.dumpEvents)
+process.simmerger.traceFile = cms.untracked.string(options.traceFile)
 process.simmerger_step = cms.Path(process.simmerger)
 process.end_step = cms.EndPath(process.endOfProcess)
 
@@ -54,11 +108,15 @@ process.FEVTDEBUGoutput.outputCommands.extend([
     'keep SimVertexs_*_*_*',
     'keep *_genParticles_*_*',
     ])
+if options.compact:
+    # The compact output refers to the input SimClusters
+    process.FEVTDEBUGoutput.outputCommands.append('keep SimClusters_mix_MergedCaloTruth_*')
 process.FEVTDEBUGoutput_step = cms.EndPath(process.FEVTDEBUGoutput)
 
 process.schedule = cms.Schedule(
     # process.simulation_step,
     process.simmerger_step,
     process.end_step,
-    process.FEVTDEBUGoutput_step,
     )
+if not options.throughput:
+    process.schedule.append(process.FEVTDEBUGoutput_step)
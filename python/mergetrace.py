@@ -0,0 +1,145 @@
+#!/usr/bin/env python3
+"""
+Reader of the binary merge trace of simmerger (traceFile parameter; format in
+plugins/MergeTrace.h).
+
+Print the tree and the merges of all events, or of some:
+    python3 mergetrace.py print trace.bin [--events 12 15]
+Compare two traces, e.g. before and after a change of the merging:
+    python3 mergetrace.py diff a.bin b.bin [--unordered] [--tolerance 1e-4]
+"""
+import argparse
+import struct
+import sys
+from collections import namedtuple
+
+FILE_HEADER = struct.Struct('<4sI')
+EVENT = struct.Struct('<QIIII')
+NODE = struct.Struct('<IIIiiIffff')
+MERGE = struct.Struct('<IIf')
+
+Node = namedtuple('Node', 'node parent track trackid pdgid nhits energy x y z')
+Merge = namedtuple('Merge', 'survivor absorbed distance')
+Event = namedtuple('Event', 'event run npcalohits nodes merges')
+
+
+def read_trace(path):
+    """Yields the events of a trace file; nodes is a dict by node index"""
+    with open(path, 'rb') as f:
+        magic, version = FILE_HEADER.unpack(f.read(FILE_HEADER.size))
+        if magic != b'SMTR' or version != 1:
+            raise ValueError('{0} is not a version 1 simmerger trace'.format(path))
+        while True:
+            data = f.read(EVENT.size)
+            if not data:
+                return
+            if len(data) < EVENT.size:
+                raise ValueError('{0} is truncated'.format(path))
+            event, run, npcalohits, nnodes, nmerges = EVENT.unpack(data)
+            nodes = {}
+            for fields in NODE.iter_unpack(f.read(nnodes * NODE.size)):
+                node = Node(*fields)
+                nodes[node.node] = node
+            merges = [Merge(*fields) for fields in MERGE.iter_unpack(f.read(nmerges * MERGE.size))]
+            yield Event(event, run, npcalohits, nodes, merges)
+
+
+def format_node(node):
+    return 'track {0} (node {1}, pdgid {2}, E {3:.4g}, {4} hits, centroid ({5:.2f}, {6:.2f}, {7:.2f}))'.format(
+        node.trackid, node.node, node.pdgid, node.energy, node.nhits, node.x, node.y, node.z
+        )
+
+
+def print_event(ev, out=sys.stdout):
+    out.write('Run {0} event {1}: {2} PCaloHits, {3} nodes, {4} merges\n'.format(
+        ev.run, ev.event, ev.npcalohits, len(ev.nodes), len(ev.merges)
+        ))
+    children = {}
+    for node in sorted(ev.nodes.values()):
+        children.setdefault(node.parent, []).append(node)
+    # Depth-first from the primaries, which have the root (not in the trace) as parent
+    stack = [(node, 0) for node in reversed(sorted(ev.nodes.values())) if node.parent not in ev.nodes]
+    while stack:
+        node, depth = stack.pop()
+        out.write('  ' + '--' * depth + format_node(node) + '\n')
+        stack.extend((child, depth + 1) for child in reversed(children.get(node.node, [])))
+    trackid = lambda index: ev.nodes[index].trackid if index in ev.nodes else '?'
+    for k, merge in enumerate(ev.merges):
+        out.write('  merge {0}: track {1} into track {2}, distance {3:.4g}\n'.format(
+            k, trackid(merge.absorbed), trackid(merge.survivor), merge.distance
+            ))
+
+
+def close(a, b, tolerance):
+    return abs(a - b) <= tolerance * max(1., abs(a), abs(b))
+
+
+def diff_event(a, b, unordered, tolerance, out=sys.stdout):
+    """Reports the differences between two traces of the same event; returns their number"""
+    differences = []
+    for index in sorted(set(a.nodes) | set(b.nodes)):
+        if index not in b.nodes:
+            differences.append('node {0} only in the first trace: {1}'.format(index, format_node(a.nodes[index])))
+        elif index not in a.nodes:
+            differences.append('node {0} only in the second trace: {1}'.format(index, format_node(b.nodes[index])))
+        else:
+            na, nb = a.nodes[index], b.nodes[index]
+            for field in Node._fields:
+                va, vb = getattr(na, field), getattr(nb, field)
+                if va != vb and not (isinstance(va, float) and close(va, vb, tolerance)):
+                    differences.append('node {0} (track {1}): {2} {3} vs {4}'.format(index, na.trackid, field, va, vb))
+    ma, mb = a.merges, b.merges
+    if unordered:
+        ma, mb = sorted(ma), sorted(mb)
+    for k in range(max(len(ma), len(mb))):
+        if k >= len(ma) or k >= len(mb):
+            differences.append('{0} vs {1} merges'.format(len(ma), len(mb)))
+            break
+        if ma[k][:2] != mb[k][:2] or not close(ma[k].distance, mb[k].distance, tolerance):
+            differences.append('first different merge, #{0}: {1} vs {2}'.format(k, ma[k], mb[k]))
+            break
+    if differences:
+        out.write('Run {0} event {1}:\n'.format(a.run, a.event))
+        for difference in differences:
+            out.write('  ' + difference + '\n')
+    return len(differences)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest='command')
+    print_parser = commands.add_parser('print', help='Print a trace')
+    print_parser.add_argument('trace')
+    print_parser.add_argument('--events', type=int, nargs='*', help='Only these event numbers')
+    diff_parser = commands.add_parser('diff', help='Compare two traces event by event')
+    diff_parser.add_argument('first')
+    diff_parser.add_argument('second')
+    diff_parser.add_argument('--unordered', action='store_true',
+        help='Compare the merges as sets, for traces made with parallelSubtrees or streamSubtrees')
+    diff_parser.add_argument('--tolerance', type=float, default=0.,
+        help='Relative tolerance for energies, centroids and distances')
+    args = parser.parse_args()
+
+    if args.command == 'print':
+        for ev in read_trace(args.trace):
+            if args.events is None or ev.event in args.events:
+                print_event(ev)
+    elif args.command == 'diff':
+        # Events are matched by run and event number, since streams write them in any order
+        first = {(ev.run, ev.event): ev for ev in read_trace(args.first)}
+        second = {(ev.run, ev.event): ev for ev in read_trace(args.second)}
+        n_different = 0
+        for key in sorted(set(first) | set(second)):
+            if key not in second or key not in first:
+                print('Run {0} event {1} only in the {2} trace'.format(key[0], key[1], 'first' if key in first else 'second'))
+                n_different += 1
+            elif diff_event(first[key], second[key], args.unordered, args.tolerance):
+                n_different += 1
+        print('{0} of {1} events differ'.format(n_different, len(set(first) | set(second))))
+        sys.exit(1 if n_different else 0)
+    else:
+        parser.print_help()
+
+
+if __name__ == '__main__':
+    main()
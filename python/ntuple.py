@@ -14,6 +14,7 @@ output_file = options.inputFiles[0].replace('SIM', 'NTUPLE')
 if output_file == options.inputFiles[0]:
     raise Exception('About to overwrite input!')
 process.TFileService = cms.Service("TFileService", fileName=cms.string(output_file))
+process.hgcalCellTableESProducer = cms.ESProducer("HGCalCellTableESProducer")
 process.ntupler = cms.EDAnalyzer("hgcalfinecalontupler")
 process.step = cms.Path(process.ntupler)
 process.end_step = cms.EndPath(process.endOfProcess)
@@ -0,0 +1,4 @@
+#include "FWCore/Utilities/interface/typelookup.h"
+#include "SimMerging/SimMerger/interface/HGCalCellTable.h"
+
+TYPELOOKUP_DATA_REG(HGCalCellTable);
@@ -0,0 +1,26 @@
+#include <vector>
+#include <algorithm>
+
+#include "DataFormats/ForwardDetId/interface/ForwardSubdetector.h"
+#include "Geometry/CaloGeometry/interface/CaloGeometry.h"
+#include "Geometry/CaloGeometry/interface/CaloSubdetectorGeometry.h"
+#include "RecoLocalCalo/HGCalRecAlgos/interface/RecHitTools.h"
+#include "SimMerging/SimMerger/interface/HGCalCellTable.h"
+
+HGCalCellTable::HGCalCellTable(const CaloGeometry& geom){
+    hgcal::RecHitTools tools;
+    tools.setGeometry(geom);
+    std::vector<DetId> ids;
+    for (auto det : {DetId::HGCalEE, DetId::HGCalHSi, DetId::HGCalHSc}){
+        const CaloSubdetectorGeometry* subGeom = geom.getSubdetectorGeometry(det, ForwardSubdetector::ForwardEmpty);
+        if (!subGeom) continue;
+        const std::vector<DetId>& valid = subGeom->getValidDetIds();
+        ids.insert(ids.end(), valid.begin(), valid.end());
+        }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    rawId_.reserve(ids.size());
+    x_.reserve(ids.size()); y_.reserve(ids.size()); z_.reserve(ids.size());
+    layer_.reserve(ids.size()); det_.reserve(ids.size());
+    for (const DetId& id : ids) addCell(id, tools.getPosition(id), tools.getLayer(id));
+    }
@@ -0,0 +1,302 @@
+#include <memory>
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+
+#include "FWCore/Framework/interface/Frameworkfwd.h"
+#include "FWCore/Framework/interface/global/EDProducer.h"
+#include "FWCore/Framework/interface/global/EDAnalyzer.h"
+#include "FWCore/Framework/interface/ESProducer.h"
+#include "FWCore/Framework/interface/ModuleFactory.h"
+#include "FWCore/Framework/interface/Event.h"
+#include "FWCore/Framework/interface/MakerMacros.h"
+#include "FWCore/ParameterSet/interface/ParameterSet.h"
+#include "FWCore/Utilities/interface/Exception.h"
+#include "DataFormats/Common/interface/Association.h"
+#include "DataFormats/DetId/interface/DetId.h"
+#include "Geometry/Records/interface/CaloGeometryRecord.h"
+#include "SimDataFormats/Track/interface/SimTrackContainer.h"
+#include "SimDataFormats/Vertex/interface/SimVertexContainer.h"
+#include "SimDataFormats/CaloHit/interface/PCaloHitContainer.h"
+#include "SimDataFormats/CaloAnalysis/interface/SimCluster.h"
+#include "SimDataFormats/CaloAnalysis/interface/SimClusterFwd.h"
+#include "SimMerging/SimMerger/interface/HGCalCellTable.h"
+
+/*
+Plugins for testSimMergerModes_cfg.py: synthetic events for simmerger on a synthetic cell
+grid, and a comparison of the compact output of several simmerger configurations.
+*/
+
+namespace {
+
+/*
+The cell grid of the synthetic events: 1 cm cells, kCellsPerRow x kCellsPerRow per layer and
+1 cm per layer; the first third of the layers is HGCalEE, the second HGCalHSi, the last
+HGCalHSc. The raw ids grow with the layer, then y, then x.
+*/
+const unsigned kCellsPerRow = 128;
+const unsigned kLayers = 48;
+
+DetId::Detector testDetector(unsigned layer){
+    return layer < kLayers/3 ? DetId::HGCalEE : (layer < 2*kLayers/3 ? DetId::HGCalHSi : DetId::HGCalHSc);
+    }
+
+uint32_t testCellId(unsigned ix, unsigned iy, unsigned layer){
+    return ((uint32_t)testDetector(layer) << 28) | (layer << 20) | (iy << 10) | ix;
+    }
+
+GlobalPoint testCellPosition(unsigned ix, unsigned iy, unsigned layer){
+    return GlobalPoint(float(ix) - kCellsPerRow/2 + 0.5f, float(iy) - kCellsPerRow/2 + 0.5f, 320.f + layer);
+    }
+
+struct TestTrack {
+    int id;
+    int parentId; // -1 for a primary
+    float energy;
+    int pdgId;
+    };
+
+struct TestHit {
+    uint32_t id;
+    float energy;
+    float time;
+    int trackId;
+    };
+
+/*
+A synthetic event: nPrimaries primaries with chains of secondaries, with hits scattered around
+a position that drifts along each chain. It covers what the modes of simmerger treat
+differently: tracks without hits (to be trimmed), parents stored after their children,
+several hits of one track in one cell (to be aggregated), hits in all three subdetectors,
+and hits of tracks that were not saved. The track ids are 1, 1+idStride, 1+2*idStride, ...
+The hits are sorted into the EE, HEfront and HEback collections.
+*/
+void makeTestEvent(
+        unsigned seed, int nPrimaries, int nTracks, int idStride,
+        std::vector<TestTrack>& tracks, std::vector<TestHit> (&hits)[3]
+        ){
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> uniform(0.f, 1.f);
+    std::normal_distribution<float> normal(0.f, 1.f);
+    tracks.clear();
+    for (auto& collection : hits) collection.clear();
+    std::vector<GlobalPoint> position;
+    auto addHit = [&](const GlobalPoint& p, float energy, float time, int trackId){
+        int ix = std::clamp(int(p.x() + kCellsPerRow/2), 0, int(kCellsPerRow)-1);
+        int iy = std::clamp(int(p.y() + kCellsPerRow/2), 0, int(kCellsPerRow)-1);
+        int layer = std::clamp(int(p.z() - 320.f), 0, int(kLayers)-1);
+        DetId::Detector det = testDetector(layer);
+        int collection = det == DetId::HGCalEE ? 0 : (det == DetId::HGCalHSi ? 1 : 2);
+        hits[collection].push_back(TestHit{testCellId(ix, iy, layer), energy, time, trackId});
+        };
+    for (int k = 0; k < nTracks; ++k){
+        TestTrack track{1 + k*idStride, -1, 1.f + 50.f*uniform(rng), uniform(rng) < 0.5f ? 22 : 11};
+        if (k < nPrimaries){
+            position.emplace_back(100.f*(uniform(rng)-0.5f), 100.f*(uniform(rng)-0.5f), 320.f + 2.f*uniform(rng));
+            }
+        else {
+            // Mostly one of the last few tracks as parent, for deep chains
+            int parent = uniform(rng) < 0.6f ? std::max(0, k - 1 - int(5*uniform(rng))) : int(k*uniform(rng));
+            track.parentId = tracks[parent].id;
+            const GlobalPoint& p = position[parent];
+            position.emplace_back(p.x() + 3.f*normal(rng), p.y() + 3.f*normal(rng), p.z() + 1.5f*uniform(rng));
+            }
+        tracks.push_back(track);
+        if (uniform(rng) < 0.2f) continue;
+        int nHits = 1 + int(10*uniform(rng));
+        for (int ihit = 0; ihit < nHits; ++ihit){
+            const GlobalPoint& p = position.back();
+            GlobalPoint hitPosition(p.x() + normal(rng), p.y() + normal(rng), p.z() + normal(rng));
+            float energy = 0.001f + 0.1f*uniform(rng), time = 30.f*uniform(rng);
+            if (uniform(rng) < 0.3f){
+                // Two PCaloHits of the track in the same cell
+                addHit(hitPosition, 0.5f*energy, time, track.id);
+                addHit(hitPosition, 0.5f*energy, time + 1.f, track.id);
+                }
+            else addHit(hitPosition, energy, time, track.id);
+            if (uniform(rng) < 0.02f) addHit(hitPosition, energy, time, 1 + (nTracks+1)*idStride);
+            }
+        }
+    // Store the second half in reverse, so that some parents come after their children
+    std::reverse(tracks.begin() + nTracks/2, tracks.end());
+    }
+
+} // namespace
+
+// _______________________________________________
+
+
+/* The SimTracks, SimVertices and HGCAL PCaloHits of synthetic events, in place of g4SimHits */
+class SimMergerTestEventProducer : public edm::global::EDProducer<> {
+    public:
+        explicit SimMergerTestEventProducer(const edm::ParameterSet&);
+    private:
+        void produce(edm::StreamID, edm::Event&, const edm::EventSetup&) const override;
+        unsigned seed_; // The seed of an event is this plus the event number
+        int nPrimaries_;
+        int nTracks_;
+        int trackIdStride_;
+    };
+
+SimMergerTestEventProducer::SimMergerTestEventProducer(const edm::ParameterSet& iConfig) :
+    seed_(iConfig.getParameter<unsigned>("seed")),
+    nPrimaries_(iConfig.getParameter<int>("nPrimaries")),
+    nTracks_(iConfig.getParameter<int>("nTracks")),
+    trackIdStride_(iConfig.getParameter<int>("trackIdStride"))
+    {
+    produces<edm::SimTrackContainer>();
+    produces<edm::SimVertexContainer>();
+    produces<edm::PCaloHitContainer>("HGCHitsEE");
+    produces<edm::PCaloHitContainer>("HGCHitsHEfront");
+    produces<edm::PCaloHitContainer>("HGCHitsHEback");
+    }
+
+void SimMergerTestEventProducer::produce(edm::StreamID, edm::Event& iEvent, const edm::EventSetup&) const {
+    std::vector<TestTrack> tracks;
+    std::vector<TestHit> hits[3];
+    makeTestEvent(seed_ + iEvent.id().event(), nPrimaries_, nTracks_, trackIdStride_, tracks, hits);
+
+    // Every SimTrack starts at its own SimVertex, which refers to the parent track
+    auto simTracks = std::make_unique<edm::SimTrackContainer>();
+    auto simVertices = std::make_unique<edm::SimVertexContainer>();
+    for (const TestTrack& track : tracks){
+        simVertices->emplace_back(math::XYZVectorD(0., 0., 0.), 0., track.parentId, simVertices->size());
+        SimTrack& simTrack = simTracks->emplace_back(
+            track.pdgId, math::XYZTLorentzVectorD(0., 0., track.energy, track.energy), simVertices->size()-1, -1
+            );
+        simTrack.setTrackId(track.id);
+        }
+    iEvent.put(std::move(simTracks));
+    iEvent.put(std::move(simVertices));
+    const char* instances[] = {"HGCHitsEE", "HGCHitsHEfront", "HGCHitsHEback"};
+    for (int i = 0; i < 3; ++i){
+        auto simHits = std::make_unique<edm::PCaloHitContainer>();
+        for (const TestHit& hit : hits[i]) simHits->emplace_back(hit.id, hit.energy, hit.time, hit.trackId);
+        iEvent.put(std::move(simHits), instances[i]);
+        }
+    }
+
+/* One SimCluster per SimTrack, and the association from the SimTracks, in place of mix */
+class SimMergerTestTruthProducer : public edm::global::EDProducer<> {
+    public:
+        explicit SimMergerTestTruthProducer(const edm::ParameterSet&);
+    private:
+        void produce(edm::StreamID, edm::Event&, const edm::EventSetup&) const override;
+        edm::EDGetTokenT<edm::SimTrackContainer> tokenSimTracks;
+    };
+
+SimMergerTestTruthProducer::SimMergerTestTruthProducer(const edm::ParameterSet&) :
+    tokenSimTracks(consumes<edm::SimTrackContainer>(edm::InputTag("g4SimHits")))
+    {
+    produces<SimClusterCollection>("MergedCaloTruth");
+    produces<edm::Association<SimClusterCollection>>("simTrackToSimCluster");
+    }
+
+void SimMergerTestTruthProducer::produce(edm::StreamID, edm::Event& iEvent, const edm::EventSetup&) const {
+    edm::Handle<edm::SimTrackContainer> handleSimTracks;
+    iEvent.getByToken(tokenSimTracks, handleSimTracks);
+    auto clusters = std::make_unique<SimClusterCollection>();
+    std::vector<int> indices;
+    for (const SimTrack& track : *handleSimTracks){
+        indices.push_back(clusters->size());
+        clusters->emplace_back(track);
+        }
+    const auto& clustersHandle = iEvent.put(std::move(clusters), "MergedCaloTruth");
+
+    auto assoc = std::make_unique<edm::Association<SimClusterCollection>>(clustersHandle);
+    edm::Association<SimClusterCollection>::Filler filler(*assoc);
+    filler.insert(handleSimTracks, indices.begin(), indices.end());
+    filler.fill();
+    iEvent.put(std::move(assoc), "simTrackToSimCluster");
+    }
+
+/* The HGCalCellTable of the cell grid of the synthetic events */
+class SimMergerTestCellTableESProducer : public edm::ESProducer {
+    public:
+        explicit SimMergerTestCellTableESProducer(const edm::ParameterSet&){ setWhatProduced(this); }
+        std::unique_ptr<HGCalCellTable> produce(const CaloGeometryRecord&);
+    };
+
+std::unique_ptr<HGCalCellTable> SimMergerTestCellTableESProducer::produce(const CaloGeometryRecord&) {
+    auto table = std::make_unique<HGCalCellTable>();
+    for (unsigned layer = 0; layer < kLayers; ++layer){
+        for (unsigned iy = 0; iy < kCellsPerRow; ++iy){
+            for (unsigned ix = 0; ix < kCellsPerRow; ++ix){
+                table->addCell(DetId(testCellId(ix, iy, layer)), testCellPosition(ix, iy, layer), layer);
+                }
+            }
+        }
+    return table;
+    }
+
+/*
+Compares the compact output (offsets, keys and pdgIds) of the simmerger instances in modes
+with that of reference, and throws on the first event where any of them differs. An event in
+which the reference merged nothing also fails, since it would not test anything.
+*/
+class SimMergerModeComparison : public edm::global::EDAnalyzer<> {
+    public:
+        explicit SimMergerModeComparison(const edm::ParameterSet&);
+    private:
+        struct CompactTokens {
+            std::string label;
+            edm::EDGetTokenT<std::vector<unsigned>> offsets;
+            edm::EDGetTokenT<std::vector<unsigned>> keys;
+            edm::EDGetTokenT<std::vector<int>> pdgIds;
+            };
+        CompactTokens compactTokens(const std::string& label){
+            return CompactTokens{
+                label,
+                consumes<std::vector<unsigned>>(edm::InputTag(label, "offsets")),
+                consumes<std::vector<unsigned>>(edm::InputTag(label, "keys")),
+                consumes<std::vector<int>>(edm::InputTag(label, "pdgIds"))
+                };
+            }
+        void analyze(edm::StreamID, const edm::Event&, const edm::EventSetup&) const override;
+        CompactTokens reference_;
+        std::vector<CompactTokens> modes_;
+    };
+
+SimMergerModeComparison::SimMergerModeComparison(const edm::ParameterSet& iConfig) :
+    reference_(compactTokens(iConfig.getParameter<std::string>("reference")))
+    {
+    for (const std::string& label : iConfig.getParameter<std::vector<std::string>>("modes")) modes_.push_back(compactTokens(label));
+    }
+
+void SimMergerModeComparison::analyze(edm::StreamID, const edm::Event& iEvent, const edm::EventSetup&) const {
+    const std::vector<unsigned>& offsets = iEvent.get(reference_.offsets);
+    const std::vector<unsigned>& keys = iEvent.get(reference_.keys);
+    const std::vector<int>& pdgIds = iEvent.get(reference_.pdgIds);
+    size_t nClusters = pdgIds.size();
+    if (keys.size() == nClusters){
+        throw cms::Exception("SimMergerModeComparison")
+            << "Nothing was merged by " << reference_.label << " in event " << iEvent.id().event()
+            ;
+        }
+    for (const CompactTokens& mode : modes_){
+        const std::vector<unsigned>& modeOffsets = iEvent.get(mode.offsets);
+        const std::vector<unsigned>& modeKeys = iEvent.get(mode.keys);
+        const std::vector<int>& modePdgIds = iEvent.get(mode.pdgIds);
+        if (modeOffsets == offsets && modeKeys == keys && modePdgIds == pdgIds) continue;
+        size_t first = 0;
+        size_t nCommon = std::min(nClusters, modePdgIds.size());
+        auto sameCluster = [&](size_t i){
+            return modePdgIds[i] == pdgIds[i]
+                && std::equal(modeKeys.begin() + modeOffsets[i], modeKeys.begin() + modeOffsets[i+1],
+                    keys.begin() + offsets[i], keys.begin() + offsets[i+1]);
+            };
+        while (first < nCommon && sameCluster(first)) first++;
+        throw cms::Exception("SimMergerModeComparison")
+            << mode.label << " gives " << modePdgIds.size() << " clusters and " << reference_.label
+            << " " << nClusters << " in event " << iEvent.id().event()
+            << "; the first difference is in cluster " << first
+            ;
+        }
+    }
+
+DEFINE_FWK_MODULE(SimMergerTestEventProducer);
+DEFINE_FWK_MODULE(SimMergerTestTruthProducer);
+DEFINE_FWK_EVENTSETUP_MODULE(SimMergerTestCellTableESProducer);
+DEFINE_FWK_MODULE(SimMergerModeComparison);
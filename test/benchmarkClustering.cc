@@ -0,0 +1,84 @@
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <memory_resource>
+
+#include "SimMerging/SimMerger/interface/SimTreeMerging.h"
+
+/*
+Benchmark of the clustering of a leafparent: the full rescan, which recomputes every pairwise
+squared distance with the batched kernel after every merge (bruteForceMerging), against the
+nearest-neighbour cache of ClusteringEngine. The event is one primary with n children that have hits, spread over a
+60 cm cube, so that many pairs are within the default merge radius of 10 cm. Both must give
+the same clusters; the times are per event, for the merging only.
+    benchmarkClustering [n ...]   (default: 100 200 400 800 1600)
+*/
+
+void makeLeafparent(SimTree& tree, unsigned seed, int nChildren){
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> uniform(0.f, 1.f);
+    std::normal_distribution<float> normal(0.f, 1.f);
+    tree.clear(nChildren+1, 4*nChildren);
+    NodeIndex primary = tree.addNode(0, 100.f, 22, 0);
+    tree.addChild(tree.root(), primary);
+    for (int track = 1; track <= nChildren; ++track){
+        NodeIndex node = tree.addNode(track, 1.f + 50.f*uniform(rng), uniform(rng) < 0.5f ? 22 : 11, track);
+        tree.addChild(primary, node);
+        GlobalPoint p(60.f*uniform(rng), 60.f*uniform(rng), 320.f + 60.f*uniform(rng));
+        for (int ihit = 0; ihit < 4; ++ihit){
+            tree.addHit(p.x() + normal(rng), p.y() + normal(rng), p.z() + normal(rng), 0.f, 0.01f + uniform(rng), track);
+            }
+        }
+    tree.sortHits(nChildren+1);
+    for (int track = 0; track <= nChildren; ++track) tree.setHits(track+1, track);
+    }
+
+/* The track ids of every cluster after merging */
+std::vector<std::vector<int>> clusters(SimTree& tree){
+    std::vector<std::vector<int>> result;
+    for (NodeIndex cluster = tree.firstChild_[tree.root()]; cluster != kNoNode; cluster = tree.nextSibling_[cluster]){
+        result.emplace_back();
+        for (uint32_t member = tree.firstMember_[cluster]; member != SimTree::kNoMember; member = tree.memberNext_[member]){
+            result.back().push_back(tree.memberTrack_[member]);
+            }
+        }
+    return result;
+    }
+
+/* Merges the events with one engine; returns the time per event in ms and the clusters */
+double timeMerging(bool bruteForce, int nChildren, int nEvents, std::vector<std::vector<int>>& result){
+    SimTree tree;
+    ClusteringEngine engine(bruteForce);
+    double total = 0.;
+    result.clear();
+    for (int ievent = 0; ievent < nEvents; ++ievent){
+        makeLeafparent(tree, 1 + ievent, nChildren);
+        auto start = std::chrono::steady_clock::now();
+        merging_algo_Mar03(tree, engine, std::pmr::new_delete_resource(), 10.f, nullptr);
+        total += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        for (auto& cluster : clusters(tree)) result.push_back(cluster);
+        }
+    return total / nEvents;
+    }
+
+int main(int argc, char** argv){
+    std::vector<int> sizes;
+    for (int i = 1; i < argc; ++i) sizes.push_back(std::atoi(argv[i]));
+    if (sizes.empty()) sizes = {100, 200, 400, 800, 1600};
+    bool identical = true;
+    std::printf("%8s %22s %14s %9s\n", "n", "bruteForce (rescan)", "nn-cache", "clusters");
+    for (int n : sizes){
+        // Fewer events for the slow sizes, at least one
+        int nEvents = std::max(1, 20000 / n / (n > 400 ? 10 : 1));
+        std::vector<std::vector<int>> before, after;
+        double bruteForceTime = timeMerging(true, n, nEvents, before);
+        double cacheTime = timeMerging(false, n, nEvents, after);
+        bool same = before == after;
+        identical = identical && same;
+        std::printf("%8d %19.2f ms %11.2f ms %9zu%s\n", n, bruteForceTime, cacheTime, after.size() / nEvents, same ? "" : "  DIFFERENT CLUSTERS");
+        }
+    return identical ? 0 : 1;
+    }
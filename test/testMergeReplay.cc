@@ -0,0 +1,92 @@
+#include <vector>
+#include <random>
+#include <numeric>
+#include <iostream>
+#include <algorithm>
+#include <memory_resource>
+
+#include "SimMerging/SimMerger/interface/SimTreeMerging.h"
+#include "SimMerging/SimMerger/interface/MergeReplay.h"
+
+/*
+Checks that replayMerging reproduces the clustering of a real re-run of the merging, for
+radii below and above the one of the recorded event. The events are synthetic showers: a few
+primaries with chains of secondaries, with hits scattered around a position that drifts
+along each chain, and some intermediates without hits.
+*/
+
+/* Fills tree with a synthetic event; SimTrack i is node i+1, and also the key of its SimCluster */
+void makeEvent(SimTree& tree, unsigned seed, int nPrimaries, int nTracks){
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> uniform(0.f, 1.f);
+    std::normal_distribution<float> normal(0.f, 1.f);
+    tree.clear(nTracks, 0);
+    std::vector<GlobalPoint> position;
+    for (int track = 0; track < nTracks; ++track){
+        NodeIndex node = tree.addNode(track, 1.f + 50.f*uniform(rng), uniform(rng) < 0.5f ? 22 : 11, track);
+        if (track < nPrimaries){
+            tree.addChild(tree.root(), node);
+            position.emplace_back(300.f*(uniform(rng)-0.5f), 300.f*(uniform(rng)-0.5f), 320.f);
+            }
+        else {
+            // Mostly one of the last few tracks as parent, for deep chains
+            int parent = uniform(rng) < 0.6f ? std::max(0, track - 1 - int(5*uniform(rng))) : int(track*uniform(rng));
+            tree.addChild(parent+1, node);
+            const GlobalPoint& p = position[parent];
+            position.emplace_back(p.x() + 3.f*normal(rng), p.y() + 3.f*normal(rng), p.z() + 4.f*uniform(rng));
+            }
+        if (uniform(rng) < 0.2f) continue;
+        int nHits = 1 + int(10*uniform(rng));
+        for (int ihit = 0; ihit < nHits; ++ihit){
+            const GlobalPoint& p = position.back();
+            tree.addHit(p.x() + normal(rng), p.y() + normal(rng), p.z() + normal(rng), 0.f, 0.01f + uniform(rng), track);
+            }
+        }
+    tree.sortHits(nTracks);
+    for (int track = 0; track < nTracks; ++track) tree.setHits(track+1, track);
+    }
+
+/* Representative SimTrack of every SimTrack after merging, as returned by replayMerging */
+std::vector<unsigned> representatives(const SimTree& tree, size_t nTracks){
+    std::vector<unsigned> representative(nTracks);
+    std::iota(representative.begin(), representative.end(), 0u);
+    for (NodeIndex cluster = tree.firstChild_[tree.root()]; cluster != kNoNode; cluster = tree.nextSibling_[cluster]){
+        for (uint32_t member = tree.firstMember_[cluster]; member != SimTree::kNoMember; member = tree.memberNext_[member]){
+            representative[tree.memberTrack_[member]] = tree.track_[cluster];
+            }
+        }
+    return representative;
+    }
+
+int main(){
+    const int nTracks = 2000;
+    const float recordedRadius = 10.f;
+    int nFailed = 0;
+    for (unsigned seed = 1; seed <= 5; ++seed){
+        // Record the tree, then merge it as simmerger does
+        SimTree tree;
+        makeEvent(tree, seed, 5, nTracks);
+        MergeTreeSnapshot snapshot;
+        for (NodeIndex top = tree.firstChild_[tree.root()]; top != kNoNode; top = tree.nextSibling_[top]) snapshot.add(tree, top);
+        ClusteringEngine engine;
+        merging_algo_Mar03(tree, engine, std::pmr::new_delete_resource(), recordedRadius, nullptr);
+
+        for (float radius : {0.f, 2.f, 5.f, recordedRadius, 20.f}){
+            std::vector<unsigned> replayed = replayMerging(nTracks, snapshot.nodes_, snapshot.sums_, snapshot.firstHits_, radius);
+            // A real re-run, with either engine
+            for (bool bruteForce : {false, true}){
+                SimTree rerun;
+                makeEvent(rerun, seed, 5, nTracks);
+                ClusteringEngine rerunEngine(bruteForce);
+                merging_algo_Mar03(rerun, rerunEngine, std::pmr::new_delete_resource(), radius, nullptr);
+                if (replayed != representatives(rerun, nTracks)){
+                    std::cout << "Event " << seed << ", radius " << radius << (bruteForce ? " (brute force)" : "")
+                        << ": the replay differs from the re-run" << std::endl;
+                    nFailed++;
+                    }
+                }
+            }
+        }
+    std::cout << (nFailed ? "FAILED" : "OK") << std::endl;
+    return nFailed ? 1 : 0;
+    }
@@ -0,0 +1,64 @@
+import FWCore.ParameterSet.Config as cms
+from FWCore.ParameterSet.VarParsing import VarParsing
+options = VarParsing("analysis")
+options.register(
+    'sparseTrackIds', False, VarParsing.multiplicity.singleton, VarParsing.varType.bool,
+    'Number the SimTracks 1, 1001, 2001, ... instead of 1, 2, 3, ...'
+    )
+options.parseArguments()
+
+# Runs simmerger in each of its modes on synthetic events, and fails if the merged clusters
+# of any mode differ from those of the default configuration
+process = cms.Process('testSimMergerModes')
+process.load('FWCore.MessageService.MessageLogger_cfi')
+
+process.source = cms.Source("EmptySource")
+process.maxEvents = cms.untracked.PSet(input = cms.untracked.int32(10))
+process.options = cms.untracked.PSet(
+    numberOfThreads = cms.untracked.uint32(4),
+    numberOfStreams = cms.untracked.uint32(2),
+    )
+
+process.caloGeometryRecordSource = cms.ESSource("EmptyESSource",
+    recordName = cms.string('CaloGeometryRecord'),
+    iovIsRunNotTime = cms.bool(True),
+    firstValid = cms.vuint32(1),
+    )
+process.hgcalCellTableESProducer = cms.ESProducer("SimMergerTestCellTableESProducer")
+
+# In place of the SIM step and the mixing: the labels simmerger reads its inputs from
+process.g4SimHits = cms.EDProducer("SimMergerTestEventProducer",
+    seed = cms.uint32(1),
+    nPrimaries = cms.int32(5),
+    nTracks = cms.int32(2000),
+    trackIdStride = cms.int32(1000 if options.sparseTrackIds else 1),
+    )
+process.mix = cms.EDProducer("SimMergerTestTruthProducer")
+
+process.reference = cms.EDProducer("simmerger",
+    fullOutput = cms.bool(False),
+    compactOutput = cms.bool(True),
+    )
+process.bruteForce = process.reference.clone(bruteForceMerging = True)
+process.parallel = process.reference.clone(parallelSubtrees = True)
+process.aggregated = process.reference.clone(aggregateHits = True)
+# Cuts that keep every hit of the synthetic events, so the clusters must not change
+process.prefilter = process.reference.clone(minHitEnergy = 1e-4, maxHitTime = 100.)
+process.streaming = process.reference.clone(streamSubtrees = True)
+# Too small for any event, so every event falls back to streaming
+process.memoryCeiling = process.reference.clone(maxEventMemoryMB = 0.01)
+process.streamingAggregated = process.reference.clone(streamSubtrees = True, aggregateHits = True)
+
+modes = ['bruteForce', 'parallel', 'aggregated', 'prefilter', 'streaming', 'memoryCeiling', 'streamingAggregated']
+process.comparison = cms.EDAnalyzer("SimMergerModeComparison",
+    reference = cms.string('reference'),
+    modes = cms.vstring(modes),
+    )
+
+process.producers = cms.Task(
+    process.g4SimHits,
+    process.mix,
+    process.reference,
+    *[getattr(process, mode) for mode in modes]
+    )
+process.comparison_step = cms.Path(process.comparison, process.producers)
@@ -0,0 +1,26 @@
+#!/bin/bash
+# Events/s of simmerger with 1, 4, 8 and 16 threads (one stream per thread), from the
+# ThroughputService summary of python/merge.py throughput=True. Run inside a CMSSW
+# environment with the package built:
+#     test/throughput.sh file:input_SIM.root [maxEvents] [threads ...]
+# The log of every run is kept in throughput_<threads>.log in the current directory.
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 inputFile [maxEvents] [threads ...]" >&2
+    exit 1
+fi
+input=$1
+maxEvents=${2:-1000}
+shift $(( $# < 2 ? $# : 2 ))
+threads=${@:-1 4 8 16}
+config=$(dirname "$0")/../python/merge.py
+
+printf "%8s %12s\n" threads "events/s"
+for n in $threads; do
+    log=throughput_$n.log
+    if ! cmsRun "$config" inputFiles="$input" maxEvents="$maxEvents" nThreads="$n" throughput=True > "$log" 2>&1; then
+        echo "cmsRun failed with $n threads, see $log" >&2
+        exit 1
+    fi
+    rate=$(grep -o 'Average throughput: [0-9.e+-]*' "$log" | tail -1 | awk '{print $3}')
+    printf "%8s %12s\n" "$n" "${rate:-?}"
+done